@@ -0,0 +1,639 @@
+/*
+
+Copyright (c) 2005-2016, University of Oxford.
+All rights reserved.
+
+University of Oxford means the Chancellor, Masters and Scholars of the
+University of Oxford, having an administrative office at Wellington
+Square, Oxford OX1 2JD, UK.
+
+This file is part of Aboria.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+ * Neither the name of the University of Oxford nor the names of its
+   contributors may be used to endorse or promote products derived from this
+   software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE
+GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+
+#ifndef BUCKETSEARCH_HASH_H_
+#define BUCKETSEARCH_HASH_H_
+
+#include "Traits.h"
+#include "Vector.h"
+#include "Log.h"
+#include "Get.h"
+#include "NeighbourSearchBase.h"
+#include "detail/SpatialUtil.h"
+#include <vector>
+#include <iostream>
+#include <cstdint>
+
+
+namespace Aboria {
+
+template <typename Traits>
+struct bucket_search_hash_query; 
+
+/// \brief Implements neighbourhood searching using a bucket search algorithm, 
+/// storing only the occupied buckets in a hash table.
+///
+/// Like bucket_search_serial, this class divides the domain into a regular grid 
+/// of constant size buckets and links the points in each bucket into a list. 
+/// However, the heads of the lists are not stored in a dense array over the 
+/// whole grid, but in an open addressing hash table keyed on the index of each 
+/// occupied bucket, so the memory used scales with the number of points and 
+/// not with the volume of the domain. The bucket size is chosen from the 
+/// volume actually occupied by the points (rather than the domain), so that 
+/// the occupied buckets hold about `n_particles_in_leaf` points each. This 
+/// makes it a good choice for sparse or clustered points in large domains.
+///
+template <typename Traits>
+class bucket_search_hash: 
+    public neighbour_search_base<bucket_search_hash<Traits>,
+                                 Traits,
+                                 bucket_search_hash_query<Traits>> {
+
+    typedef typename Traits::double_d double_d;
+    typedef typename Traits::int_d int_d;
+    typedef typename Traits::position position;
+    typedef typename Traits::vector_int vector_int;
+    typedef typename Traits::iterator iterator;
+    typedef typename Traits::unsigned_int_d unsigned_int_d;
+
+    typedef neighbour_search_base<bucket_search_hash<Traits>,
+                                 Traits,
+                                 bucket_search_hash_query<Traits>> base_type;
+
+    friend base_type;
+
+public:
+    bucket_search_hash():m_size_calculated_with_n(-1),m_n_occupied(0),base_type() {}
+    static constexpr bool cheap_copy_and_delete_at_end() {
+        return true;
+    }
+
+private:
+    // the bucket size depends on the positions of the points, so this only 
+    // records the new domain and leaves the buckets to the next embed
+    void set_domain_impl() {
+        m_size_calculated_with_n = -1;
+        this->m_query.m_bounds.bmin = this->m_bounds.bmin;
+        this->m_query.m_bounds.bmax = this->m_bounds.bmax;
+        this->m_query.m_periodic = this->m_periodic;
+    }
+
+    bool needs_new_bucket_size(const size_t n) const {
+        return n < 0.5*m_size_calculated_with_n || n > 2*m_size_calculated_with_n;
+    }
+
+    void set_bucket_size(const double box_side_length) {
+        const double_d width = this->m_bounds.bmax-this->m_bounds.bmin;
+
+        // limit the number of buckets so their keys fit into 64 bits
+        const int max_size = 1 << std::min(30,62/int(Traits::dimension));
+        for (int i=0; i<Traits::dimension; ++i) {
+            const double size = std::floor(width[i]/box_side_length);
+            m_size[i] = size < 1 ? 1 : (size > max_size ? max_size : size);
+        }
+        m_bucket_side_length = width/m_size;
+
+        this->m_query.m_bucket_side_length = m_bucket_side_length;
+        this->m_query.m_end_bucket = m_size-1;
+    }
+
+    void calculate_bucket_size() {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        m_size_calculated_with_n = n;
+        LOG(2,"bucket_search_hash: recalculating bucket size");
+
+        const double_d width = this->m_bounds.bmax-this->m_bounds.bmin;
+        if (this->m_n_particles_in_leaf >= n) {
+            set_bucket_size(width.maxCoeff());
+        } else {
+            // start with the bucket size for points evenly spread over 
+            // their bounding box
+            detail::bbox<Traits::dimension> bounds;
+            for (size_t i=0; i<n; ++i) {
+                bounds = bounds + detail::bbox<Traits::dimension>(
+                                    get<position>(this->m_particles_begin)[i]);
+            }
+            double_d occupied_width = bounds.bmax-bounds.bmin;
+            for (int i=0; i<Traits::dimension; ++i) {
+                const double min_width = width[i]/(1 << std::min(30,62/int(Traits::dimension)));
+                if (occupied_width[i] < min_width) occupied_width[i] = min_width;
+            }
+            const double ratio = double(this->m_n_particles_in_leaf)/double(n);
+            double box_side_length = std::pow(ratio*occupied_width.prod(),
+                                              1.0/Traits::dimension);
+            set_bucket_size(box_side_length);
+
+            // clustered points fill only part of their bounding box, so 
+            // shrink the buckets (by at least half each time) until the 
+            // occupied buckets hold about n_particles_in_leaf points each
+            for (int iteration=0; iteration<16; ++iteration) {
+                reset_table(n);
+                for (size_t i=0; i<n; ++i) {
+                    find_or_insert_bucket(get<position>(this->m_particles_begin)[i]);
+                }
+                const double particles_per_bucket = double(n)/m_n_occupied;
+                if (particles_per_bucket < 2*this->m_n_particles_in_leaf) break;
+                const unsigned_int_d old_size = m_size;
+                box_side_length *= std::min(0.5,
+                        std::pow(this->m_n_particles_in_leaf/particles_per_bucket,
+                                 1.0/Traits::dimension));
+                set_bucket_size(box_side_length);
+                if ((m_size == old_size).all()) break;
+            }
+        }
+
+        LOG(2,"\tbucket side length = "<<m_bucket_side_length);
+        LOG(2,"\tnumber of buckets = "<<m_size);
+    }
+
+    // clear the hash table and size it to hold up to n occupied buckets at 
+    // a load factor of at most one half
+    void reset_table(const size_t n) {
+        int bits = 1;
+        while ((size_t(1) << bits) < 2*n) ++bits;
+        m_keys.assign(size_t(1) << bits, bucket_search_hash_query<Traits>::get_empty_key());
+        m_heads.assign(size_t(1) << bits, detail::get_empty_id());
+        m_n_occupied = 0;
+
+        this->m_query.m_hash_shift = 64 - bits;
+        this->m_query.m_hash_mask = (size_t(1) << bits) - 1;
+        this->m_query.m_keys_begin = m_keys.data();
+        this->m_query.m_heads_begin = m_heads.data();
+    }
+
+    // returns the slot in the hash table of the bucket containing \p r, 
+    // adding the bucket to the table if it is not there already. Returns 
+    // an empty id if the table is too full to add a new bucket
+    int find_or_insert_bucket(const double_d& r) {
+        const uint64_t key = m_query.get_bucket_key(m_query.find_bucket_index_vector(r));
+        const size_t slot = m_query.find_slot(key);
+        if (m_keys[slot] != key) {
+            if (2*(m_n_occupied+1) > m_keys.size()) {
+                return detail::get_empty_id();
+            }
+            m_keys[slot] = key;
+            ++m_n_occupied;
+        }
+        return slot;
+    }
+
+    void insert_point(const size_t i, const int bucketi) {
+        const int bucket_entry = m_heads[bucketi];
+
+        // Insert into own bucket
+        m_heads[bucketi] = i;
+        m_dirty_buckets[i] = bucketi;
+        m_linked_list[i] = bucket_entry;
+        m_linked_list_reverse[i] = detail::get_empty_id();
+        if (bucket_entry != detail::get_empty_id()) m_linked_list_reverse[bucket_entry] = i;
+    }
+
+    void update_iterator_impl() {
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+    }
+
+    void embed_points_impl() {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        if (needs_new_bucket_size(n)) {
+            calculate_bucket_size();
+        }
+
+        reset_table(n);
+        m_linked_list.assign(n, detail::get_empty_id());
+        m_linked_list_reverse.assign(n, detail::get_empty_id());
+        m_dirty_buckets.assign(n,detail::get_empty_id());
+        for (size_t i=0; i<n; ++i) {
+            const int bucketi = find_or_insert_bucket(get<position>(this->m_particles_begin)[i]);
+            ASSERT(bucketi != detail::get_empty_id(), "hash table full");
+            insert_point(i,bucketi);
+        }
+        LOG(2,"bucket_search_hash: embed_points: "<<m_n_occupied<<" occupied buckets in a table of size "<<m_keys.size());
+
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+    }
+
+    void add_points_at_end_impl(const size_t dist) {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        const size_t start_adding = n-dist;
+        ASSERT(m_linked_list.size() == start_adding, "m_linked_list not consistent with dist");
+        ASSERT(m_linked_list_reverse.size() == start_adding, "m_linked_list_reverse not consistent with dist");
+        ASSERT(m_dirty_buckets.size() == start_adding, "m_dirty_buckets not consistent with dist");
+        if (needs_new_bucket_size(n)) {
+            embed_points_impl();
+            return;
+        }
+        m_linked_list.resize(n,detail::get_empty_id());
+        m_linked_list_reverse.resize(n,detail::get_empty_id());
+        m_dirty_buckets.resize(n,detail::get_empty_id());
+
+        for (size_t i = start_adding; i<n; ++i) {
+            const int bucketi = find_or_insert_bucket(get<position>(this->m_particles_begin)[i]);
+            if (bucketi == detail::get_empty_id()) {
+                // the table is full, rebuild it with more space
+                embed_points_impl();
+                return;
+            }
+            insert_point(i,bucketi);
+        }
+
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+    }
+
+    void delete_points_at_end_impl(const size_t dist) {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        ASSERT(m_linked_list.size()-n == dist, "m_linked_list not consistent with dist");
+        ASSERT(m_linked_list_reverse.size()-n == dist, "m_linked_list_reverse not consistent with dist");
+        ASSERT(m_dirty_buckets.size()-n == dist, "m_dirty_buckets not consistent with dist");
+        const size_t oldn = m_linked_list.size();
+        for (size_t i = n; i<oldn; ++i) {
+            if (m_dirty_buckets[i] == detail::get_empty_id()) continue;
+            const int celli = m_dirty_buckets[i];
+
+            //get first backwards index < n
+            int backwardsi = i;
+            while (backwardsi >= n) {
+                backwardsi = m_linked_list_reverse[backwardsi];
+                if (backwardsi == detail::get_empty_id()) break;
+            }
+
+            //get first forward index < n
+            int forwardi = i;
+            while (forwardi >= n) {
+                forwardi = m_linked_list[forwardi];
+                if (forwardi == detail::get_empty_id()) break;
+            }
+
+            if (forwardi != detail::get_empty_id()) {
+                m_linked_list_reverse[forwardi] = backwardsi;
+            }
+            if (backwardsi != detail::get_empty_id()) {
+                m_linked_list[backwardsi] = forwardi;
+            } else {
+                m_heads[celli] = forwardi;
+            }
+        }
+        m_linked_list.resize(n);
+        m_linked_list_reverse.resize(n);
+        m_dirty_buckets.resize(n);
+
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+    }
+
+    size_t update_positions_impl() {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+
+        // the bucket size needs to change, or the particles are not 
+        // consistent with the linked list, so fall back to embedding all
+        // the particles
+        if (needs_new_bucket_size(n) || m_linked_list.size() != n) {
+            embed_points_impl();
+            return n;
+        }
+
+        size_t n_moved = 0;
+        for (size_t i=0; i<n; ++i) {
+            const int bucketi = find_or_insert_bucket(get<position>(this->m_particles_begin)[i]);
+            if (bucketi == detail::get_empty_id()) {
+                // the table is full of buckets that were occupied at some 
+                // point, rebuild it with only those occupied now
+                embed_points_impl();
+                return n;
+            }
+            if (bucketi != m_dirty_buckets[i]) {
+                untrack_point(i);
+                insert_point(i,bucketi);
+                ++n_moved;
+            }
+        }
+        LOG(2,"bucket_search_hash: update_positions: "<<n_moved<<" of "<<n<<" particles changed bucket");
+
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+        return n_moved;
+    }
+
+    void untrack_point(const size_t i) {
+        ASSERT((i>=0) && (i<m_linked_list.size()),"invalid untrack index");
+
+        const int forwardi = m_linked_list[i];
+        const int backwardsi = m_linked_list_reverse[i];
+
+        if (forwardi != detail::get_empty_id()) {
+            m_linked_list_reverse[forwardi] = backwardsi;
+        }
+        if (backwardsi != detail::get_empty_id()) {
+            m_linked_list[backwardsi] = forwardi;
+        } else {
+            const int celli = m_dirty_buckets[i];
+            ASSERT(m_heads[celli]==i,"inconsistant m_heads data structures!");
+            m_heads[celli] = forwardi;
+        }
+    }
+
+    void copy_points_impl(iterator copy_from_iterator, iterator copy_to_iterator) {
+        const size_t toi = std::distance(this->m_particles_begin,copy_to_iterator);
+        const size_t fromi = std::distance(this->m_particles_begin,copy_from_iterator);
+        ASSERT(toi != fromi,"toi and fromi are the same");
+
+        // unlink old toi pointers
+        untrack_point(toi);
+
+        // setup fromi <-> toi 
+        const int forwardi = m_linked_list[fromi];
+        const int bucketi = m_dirty_buckets[fromi];
+        m_linked_list[toi] = forwardi;
+        m_linked_list_reverse[toi] = fromi;
+        m_linked_list[fromi] = toi;
+        if (forwardi != detail::get_empty_id()) {
+            m_linked_list_reverse[forwardi] = toi; 
+        }
+        m_dirty_buckets[toi] = bucketi;
+    }
+
+    const bucket_search_hash_query<Traits>& get_query_impl() const {
+        return m_query;
+    }
+
+    vector_int m_linked_list;
+    vector_int m_linked_list_reverse;
+    vector_int m_dirty_buckets;
+    std::vector<uint64_t> m_keys;
+    std::vector<int> m_heads;
+    bucket_search_hash_query<Traits> m_query;
+
+    size_t m_size_calculated_with_n;
+    size_t m_n_occupied;
+    unsigned_int_d m_size;
+    double_d m_bucket_side_length;
+};
+
+template <typename Traits>
+struct bucket_search_hash_query {
+
+    typedef Traits traits_type;
+    typedef typename Traits::raw_pointer raw_pointer;
+    typedef typename Traits::double_d double_d;
+    typedef typename Traits::bool_d bool_d;
+    typedef typename Traits::int_d int_d;
+    typedef typename Traits::unsigned_int_d unsigned_int_d;
+    const static unsigned int dimension = Traits::dimension;
+    typedef lattice_iterator<dimension> query_iterator;
+    typedef lattice_iterator<dimension> all_iterator;
+    typedef lattice_iterator<dimension> child_iterator;
+    typedef typename query_iterator::reference reference;
+    typedef typename query_iterator::pointer pointer;
+    typedef typename query_iterator::value_type value_type;
+    typedef linked_list_iterator<Traits> particle_iterator;
+    typedef detail::bbox<dimension> box_type;
+
+    bool_d m_periodic;
+    double_d m_bucket_side_length; 
+    int_d m_end_bucket;
+    detail::bbox<dimension> m_bounds;
+
+    raw_pointer m_particles_begin;
+    int *m_linked_list_begin;
+    uint64_t *m_keys_begin;
+    int *m_heads_begin;
+    unsigned int m_hash_shift;
+    size_t m_hash_mask;
+
+    inline
+    CUDA_HOST_DEVICE
+    bucket_search_hash_query():
+        m_periodic(),
+        m_particles_begin(),
+        m_linked_list_begin(),
+        m_keys_begin(),
+        m_heads_begin()
+    {}
+
+    CUDA_HOST_DEVICE
+    static uint64_t get_empty_key() {
+        return ~uint64_t(0);
+    }
+
+    /// the raster indices of the bucket containing \p r. Points outside the
+    /// domain are put in the nearest bucket
+    CUDA_HOST_DEVICE
+    int_d find_bucket_index_vector(const double_d& r) const {
+        int_d bucket = floor((r-m_bounds.bmin)/m_bucket_side_length).template cast<int>();
+        for (int i=0; i<dimension; ++i) {
+            if (bucket[i] < 0) {
+                bucket[i] = 0;
+            } else if (bucket[i] > m_end_bucket[i]) {
+                bucket[i] = m_end_bucket[i];
+            }
+        }
+        return bucket;
+    }
+
+    CUDA_HOST_DEVICE
+    uint64_t get_bucket_key(const int_d& bucket) const {
+        uint64_t key = bucket[0];
+        for (int i=1; i<dimension; ++i) {
+            key = key*(m_end_bucket[i]+1) + bucket[i];
+        }
+        return key;
+    }
+
+    /// returns the slot of the hash table holding \p key, or the empty slot 
+    /// where it would be inserted
+    CUDA_HOST_DEVICE
+    size_t find_slot(const uint64_t key) const {
+        size_t slot = (key*0x9E3779B97F4A7C15ull) >> m_hash_shift;
+        while (m_keys_begin[slot] != key && m_keys_begin[slot] != get_empty_key()) {
+            slot = (slot+1) & m_hash_mask;
+        }
+        return slot;
+    }
+
+    /*
+     * functions for trees
+     */
+    static bool is_leaf_node(const value_type& bucket) {
+        return true;
+    }
+
+    static bool is_tree() {
+        return false;
+    }
+
+    child_iterator get_children() const {
+        return child_iterator(int_d(0),m_end_bucket+1);
+    }
+
+    child_iterator get_children(const child_iterator& ci) const {
+        return child_iterator();
+    }
+
+    const box_type get_bounds(const child_iterator& ci) const {
+        box_type bounds;
+        bounds.bmin = (*ci)*m_bucket_side_length + m_bounds.bmin;
+        bounds.bmax = ((*ci)+1)*m_bucket_side_length + m_bounds.bmin;
+        return bounds;
+    }
+    
+    // dodgy hack cause nullptr cannot be converted to pointer
+    static const pointer get_child1(const pointer& bucket) {
+        CHECK(false,"this should not be called")
+	    return pointer(-1);
+    }
+    static const pointer get_child2(const pointer& bucket) {
+        CHECK(false,"this should not be called")
+	    return pointer(-1);
+    }
+
+    const box_type& get_bounds() const { return m_bounds; }
+    const bool_d& get_periodic() const { return m_periodic; }
+
+    CUDA_HOST_DEVICE
+    iterator_range<particle_iterator> 
+    get_bucket_particles(const reference bucket) const {
+        ASSERT((bucket>=int_d(0)).all() && (bucket <= m_end_bucket).all(), "invalid bucket");
+        
+        const uint64_t key = get_bucket_key(bucket);
+        const size_t slot = find_slot(key);
+
+#ifndef __CUDA_ARCH__
+        LOG(4,"\tget_bucket_particles: looking in bucket "<<bucket<<" = "<<key);
+#endif
+        return iterator_range<particle_iterator>(
+                particle_iterator(m_keys_begin[slot] == key ? 
+                                        m_heads_begin[slot] : detail::get_empty_id(),
+                    m_particles_begin,
+                    m_linked_list_begin),
+                particle_iterator());
+    }
+
+    CUDA_HOST_DEVICE
+    detail::bbox<dimension> get_bucket_bbox(const reference bucket) const {
+        return detail::bbox<dimension>(
+                bucket*m_bucket_side_length + m_bounds.bmin,
+                (bucket+1)*m_bucket_side_length + m_bounds.bmin
+                );
+    }
+
+    CUDA_HOST_DEVICE
+    box_type get_root_bucket_bounds(reference bucket) const {
+        box_type bounds;
+        bounds.bmin = bucket*m_bucket_side_length + m_bounds.bmin;
+        bounds.bmax = (bucket+1)*m_bucket_side_length + m_bounds.bmin;
+        return bounds;
+    }
+
+    CUDA_HOST_DEVICE
+    void get_bucket(const double_d &position, pointer& bucket, box_type& bounds) const {
+        bucket = find_bucket_index_vector(position);
+        bounds.bmin = bucket*m_bucket_side_length + m_bounds.bmin;
+        bounds.bmax = (bucket+1)*m_bucket_side_length + m_bounds.bmin;
+    }
+
+    CUDA_HOST_DEVICE
+    size_t get_bucket_index(const reference bucket) const {
+        return get_bucket_key(bucket);
+    }
+
+    template <int LNormNumber=-1>
+    CUDA_HOST_DEVICE
+    iterator_range<query_iterator> 
+    get_buckets_near_point(const double_d &position, const double max_distance) const {
+        return get_buckets_near_point(position,double_d(max_distance));
+    }
+     
+    template <int LNormNumber=-1>
+    CUDA_HOST_DEVICE
+    iterator_range<query_iterator> 
+    get_buckets_near_point(const double_d &position, const double_d &max_distance) const {
+#ifndef __CUDA_ARCH__
+        LOG(4,"\tget_buckets_near_point: position = "<<position<<" max_distance = "<<max_distance);
+#endif
+        // not using find_bucket_index_vector, as that clamps to the domain
+        int_d start = floor((position-max_distance-m_bounds.bmin)/m_bucket_side_length)
+                                .template cast<int>();
+        int_d end = floor((position+max_distance-m_bounds.bmin)/m_bucket_side_length)
+                                .template cast<int>();
+
+        bool no_buckets = false;
+        for (int i=0; i<Traits::dimension; i++) {
+            if (start[i] < 0) {
+                start[i] = 0;
+            } else if (start[i] > m_end_bucket[i]) {
+                no_buckets = true;
+                start[i] = m_end_bucket[i];
+            }
+            if (end[i] < 0) {
+                no_buckets = true;
+                end[i] = 0;
+            } else if (end[i] > m_end_bucket[i]) {
+                end[i] = m_end_bucket[i];
+            }
+        }
+#ifndef __CUDA_ARCH__
+        LOG(4,"\tget_buckets_near_point: start = "<<start<<" end = "<<end<<" no_buckets = "<<no_buckets);
+#endif
+        if (no_buckets) {
+            return iterator_range<query_iterator>(
+                    query_iterator()
+                    ,query_iterator()
+                    );
+        } else {
+            return iterator_range<query_iterator>(
+                    query_iterator(start,end+1)
+                    ,query_iterator()
+                    );
+        }
+    }
+
+    iterator_range<all_iterator> get_subtree(const child_iterator& ci) const {
+        return iterator_range<all_iterator>(
+                all_iterator(),
+                all_iterator());
+    }
+    
+    iterator_range<all_iterator> get_subtree() const {
+        return iterator_range<all_iterator>(
+                all_iterator(int_d(0),m_end_bucket+1),
+                all_iterator()
+                );
+    }
+
+    size_t number_of_buckets() const {
+        return (m_end_bucket+1).template cast<size_t>().prod();
+    }
+
+    raw_pointer get_particles_begin() const {
+        return m_particles_begin;
+    }
+};
+
+}
+
+#endif /* BUCKETSEARCH_HASH_H_ */
@@ -261,10 +261,10 @@ private:
         if (m_bucket_indices.size() > 0) {
             m_indices.resize(m_bucket_indices.size());
             detail::sequence(m_indices.begin(), m_indices.end());
-            detail::sort_by_key(m_bucket_indices.begin(),
-                                m_bucket_indices.end(),
-                                m_indices.begin());
-            detail::reorder_destructive(m_indices.begin(), m_indices.end(), this->m_particles_begin);
+            detail::radix_sort_by_key(m_bucket_indices.begin(),
+                                      m_bucket_indices.end(),
+                                      m_indices.begin());
+            detail::reorder(m_indices.begin(), m_indices.end(), this->m_particles_begin);
         }
     }
 
@@ -47,6 +47,9 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <iostream>
 #include <set>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
 
 
 namespace Aboria {
@@ -188,6 +191,13 @@ private:
         set_domain_impl(); 
         const size_t n = this->m_particles_end - this->m_particles_begin;
 
+#if defined(HAVE_OPENMP) && !defined(__CUDACC__)
+        if (omp_get_max_threads() > 1) {
+            embed_points_parallel();
+            return;
+        }
+#endif
+
         /*
          * clear head of linked lists (m_buckets)
          */
@@ -244,6 +254,102 @@ private:
     }
 
 
+#if defined(HAVE_OPENMP) && !defined(__CUDACC__)
+    /// builds the linked lists using a parallel counting sort of the 
+    /// particles by bucket, giving the start of each bucket in 
+    /// m_bucket_begin and the sorted particle indices in m_sorted_indices.
+    /// Each bucket is linked in order of decreasing particle index, so the
+    /// result is the same as for the serial loop in embed_points_impl()
+    void embed_points_parallel() {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        const int nb = m_buckets.size();
+        m_linked_list.resize(n);
+        m_linked_list_reverse.resize(n);
+        m_dirty_buckets.resize(n);
+        m_sorted_indices.resize(n);
+        m_bucket_begin.resize(nb+1);
+
+        int* buckets = iterator_to_raw_pointer(m_buckets.begin());
+        int* linked_list = iterator_to_raw_pointer(m_linked_list.begin());
+        int* linked_list_reverse = iterator_to_raw_pointer(m_linked_list_reverse.begin());
+        int* dirty_buckets = iterator_to_raw_pointer(m_dirty_buckets.begin());
+        int* sorted = m_sorted_indices.data();
+        int* bucket_begin = m_bucket_begin.data();
+
+        #pragma omp parallel
+        {
+            const int nthreads = omp_get_num_threads();
+            const int thread = omp_get_thread_num();
+            #pragma omp single
+            m_thread_counts.assign(nthreads*nb,0);
+            int* counts = m_thread_counts.data();
+
+            // count the particles of this thread in each bucket. The 
+            // static schedule gives each thread the same particles in the
+            // scatter below, which keeps the sort stable
+            #pragma omp for schedule(static)
+            for (size_t i=0; i<n; ++i) {
+                const double_d& r = get<position>(this->m_particles_begin)[i];
+                const unsigned int bucketi = m_point_to_bucket_index.find_bucket_index(r);
+                ASSERT(bucketi < nb && bucketi >= 0, "bucket index out of range");
+                dirty_buckets[i] = bucketi;
+                ++counts[thread*nb + bucketi];
+            }
+
+            #pragma omp for
+            for (int b=0; b<nb; ++b) {
+                int count = 0;
+                for (int t=0; t<nthreads; ++t) {
+                    count += counts[t*nb + b];
+                }
+                bucket_begin[b+1] = count;
+            }
+
+            #pragma omp single
+            {
+                bucket_begin[0] = 0;
+                for (int b=0; b<nb; ++b) {
+                    bucket_begin[b+1] += bucket_begin[b];
+                }
+            }
+
+            // turn the counts into the offset of each thread in each bucket
+            #pragma omp for
+            for (int b=0; b<nb; ++b) {
+                int offset = bucket_begin[b];
+                for (int t=0; t<nthreads; ++t) {
+                    const int count = counts[t*nb + b];
+                    counts[t*nb + b] = offset;
+                    offset += count;
+                }
+            }
+
+            #pragma omp for schedule(static)
+            for (size_t i=0; i<n; ++i) {
+                sorted[counts[thread*nb + dirty_buckets[i]]++] = i;
+            }
+
+            #pragma omp for
+            for (int b=0; b<nb; ++b) {
+                const int begin = bucket_begin[b];
+                const int end = bucket_begin[b+1];
+                buckets[b] = end > begin ? sorted[end-1] : detail::get_empty_id();
+                for (int k=begin; k<end; ++k) {
+                    const int i = sorted[k];
+                    linked_list[i] = k > begin ? sorted[k-1] : detail::get_empty_id();
+                    linked_list_reverse[i] = k+1 < end ? sorted[k+1] : detail::get_empty_id();
+                }
+            }
+        }
+        m_use_dirty_cells = true;
+
+        //check_data_structure();
+
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+    }
+#endif
+
     void add_points_at_end_impl(const size_t dist) {
         set_domain_impl(); 
         const size_t n = this->m_particles_end - this->m_particles_begin;
@@ -337,34 +443,49 @@ private:
         this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
     }
 
-    void update_point(iterator update_iterator) {
-        const size_t i = std::distance(this->m_particles_begin,update_iterator);
-        const bool particle_based = true;
-
-        const int forwardi = m_linked_list[i];
-        const int backwardsi = m_linked_list_reverse[i];
+    size_t update_positions_impl() {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        const size_t old_size_calculated_with_n = m_size_calculated_with_n;
+        set_domain_impl(); 
 
-        if (forwardi != detail::get_empty_id()) {
-            m_linked_list_reverse[forwardi] = backwardsi;
+        // the buckets have been reset, or the particles are not consistent
+        // with the linked list, so fall back to embedding all the particles
+        if (m_size_calculated_with_n != old_size_calculated_with_n
+                || m_linked_list.size() != n) {
+            embed_points_impl();
+            return n;
         }
-        if (backwardsi != detail::get_empty_id()) {
-            m_linked_list[backwardsi] = forwardi;
-        } else {
-            const int celli = m_dirty_buckets[i];
-            ASSERT(m_buckets[celli]==i,"inconsistant m_buckets data structures!");
-            m_buckets[celli] = forwardi;
+
+        size_t n_moved = 0;
+        for (size_t i=0; i<n; ++i) {
+            const double_d& r = get<position>(this->m_particles_begin)[i];
+            const unsigned int bucketi = m_point_to_bucket_index.find_bucket_index(r);
+            ASSERT(bucketi < m_buckets.size() && bucketi >= 0, "bucket index out of range");
+            if (static_cast<int>(bucketi) != m_dirty_buckets[i]) {
+                update_point(i,bucketi);
+                ++n_moved;
+            }
         }
+        LOG(2,"bucket_search_serial: update_positions: "<<n_moved<<" of "<<n<<" particles changed bucket");
 
-        const int celli = find_cell_index(return_vect3d(*update_iterator));
-        const int cell_entry = m_buckets[celli];
+        //check_data_structure();
 
-        // Insert into own cell
-        m_buckets[celli] = i;
-        m_dirty_buckets[i] = celli;
-        m_linked_list[i] = cell_entry;
-        m_linked_list_reverse[i] = detail::get_empty_id();
-        if (cell_entry != detail::get_empty_id()) m_linked_list_reverse[cell_entry] = i;
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_linked_list_begin = iterator_to_raw_pointer(this->m_linked_list.begin());
+        return n_moved;
+    }
 
+    void update_point(const size_t i, const unsigned int bucketi) {
+        untrack_point(i);
+
+        const int bucket_entry = m_buckets[bucketi];
+
+        // Insert into own bucket
+        m_buckets[bucketi] = i;
+        m_dirty_buckets[i] = bucketi;
+        m_linked_list[i] = bucket_entry;
+        m_linked_list_reverse[i] = detail::get_empty_id();
+        if (bucket_entry != detail::get_empty_id()) m_linked_list_reverse[bucket_entry] = i;
     }
 
     void untrack_point(const size_t i) {
@@ -446,6 +567,9 @@ private:
     vector_int m_linked_list;
     vector_int m_linked_list_reverse;
     vector_int m_dirty_buckets;
+    std::vector<int> m_sorted_indices;
+    std::vector<int> m_bucket_begin;
+    std::vector<int> m_thread_counts;
     bucket_search_serial_query<Traits> m_query;
     bool m_use_dirty_cells;
 
@@ -47,6 +47,9 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <iostream>
 #include <set>
+#include <memory>
+#include <deque>
+#include <algorithm>
 
 namespace Aboria {
 
@@ -67,28 +70,95 @@ class nanoflann_child_iterator;
 namespace Aboria {
 namespace detail {
 
+/// The points indexed by one kd-tree of a nanoflann_adaptor, which are a 
+/// contiguous range of the particles. This is the dataset adaptor that 
+/// nanoflann uses to build the tree.
+template <typename Traits>
+struct nanoflann_dataset {
+    typedef typename Traits::double_d double_d;
+    static const unsigned int dimension = Traits::dimension;
+
+    const double_d* m_positions;
+    size_t m_size;
+    bbox<dimension> m_bounds;
+
+    nanoflann_dataset():
+        m_positions(nullptr),
+        m_size(0)
+    {}
+
+    // Must return the number of data points
+	inline size_t kdtree_get_point_count() const { 
+        return m_size;
+    }
+
+	// Returns the distance between the vector "p1[0:size-1]" 
+    // and the data point with index "idx_p2" stored in the class:
+	inline double kdtree_distance(const double *p1, const size_t idx_p2,size_t /*size*/) const
+	{
+        double ret = 0;
+        const double_d& p2 = m_positions[idx_p2];
+        for (int i = 0; i < dimension; ++i) {
+           ret += (p1[i]-p2[i])*(p1[i]-p2[i]); 
+        }
+		return ret;
+	}
+
+	// Returns the dim'th component of the idx'th point in the class:
+	inline double kdtree_get_pt(const size_t idx, int dim) const
+	{
+        return m_positions[idx][dim];
+	}
+
+	// Optional bounding-box computation: return false to default to a standard bbox computation loop.
+	//   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
+	//   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
+	template <class BBOX>
+	bool kdtree_get_bbox(BBOX& bb) const { 
+        for (int i = 0; i < dimension; ++i) {
+            bb[i].low = m_bounds.bmin[i];
+            bb[i].high = m_bounds.bmax[i];
+        }
+	    return true;
+    }
+};
+
 template <typename Traits>
 using nanoflann_kd_tree_type = 
         nanoflann::KDTreeSingleIndexAdaptor<
-            nanoflann::L_inf_Adaptor<double, nanoflann_adaptor<Traits> > ,
-            nanoflann_adaptor<Traits>,
+            nanoflann::L_inf_Adaptor<double, nanoflann_dataset<Traits> > ,
+            nanoflann_dataset<Traits>,
             Traits::dimension 
         >;
 
 }
 
-/// \brief Implements neighbourhood searching using a bucket search algorithm, dividing
-/// the domain into constant size "buckets".
+/// \brief Implements neighbourhood searching using a kd-tree built with the
+/// nanoflann library.
 ///
-/// This class implements neighbourhood searching using a bucket search algorithm. The 
-/// domain is first divided up into a regular grid of constant size "buckets", either by
-/// using the class constructor to initialise the domain extents, bucket size etc., or by 
-/// using the reset() member function to reset these parameters.
+/// embed_points() (and update_positions()) build a single kd-tree over all
+/// the points, reordering the particles so that the points in each leaf are
+/// contiguous. 
 ///
-/// After the buckets are created, a set of 3D points can be assigned to their respective buckets
-/// using the embed_points() member function. After this, neighbourhood queries around
-/// a given point can be performed using find_broadphase_neighbours(), which returns a const 
-/// iterator to all the points in the same bucket or surrounding buckets of the given point.
+/// Adding and deleting points does not rebuild this tree. Instead the points
+/// are held in a logarithmic forest of kd-trees, each over a contiguous range
+/// of the particles. Points added at the end go into a new tree, which is
+/// merged with the trees at the end of the forest that are no larger than it
+/// (as in a binary counter), so that each point is rebuilt into O(log N) 
+/// trees. A deleted point is replaced by the last point (see
+/// cheap_copy_and_delete_at_end()). Its leaf is split around it, and the
+/// moved point gets a leaf of its own under the leaf of the same tree that
+/// contains its position, so the tree still partitions the domain. The 
+/// trees then lose the points at the end. A tree is rebuilt once half of its
+/// points have been changed in this way. Insertion and deletion therefore 
+/// cost amortised O(log^2 N), and a query searches O(log N) trees. 
+///
+/// The trees of the forest are joined into a single tree for the query by
+/// nodes that do not split the domain. The leaves of the forest do not 
+/// partition the domain, so before the query finds the leaf holding a
+/// given position (get_bucket()) or walks the whole tree (get_subtree()), as
+/// used by the fast multipole and H2 methods, the points are embedded again
+/// into a single tree. Like update_positions(), this reorders the particles.
 ///
 template <typename Traits>
 class nanoflann_adaptor: 
@@ -107,67 +177,51 @@ class nanoflann_adaptor:
                                  Traits,
                                  nanoflann_adaptor_query<Traits>> base_type;
     friend base_type;
+    friend class nanoflann_adaptor_query<Traits>;
 
     typedef detail::nanoflann_kd_tree_type<Traits> kd_tree_type;
     typedef typename kd_tree_type::Node node_type;
 
+    /// a kd-tree of the forest, indexing the particles from m_begin to m_end.
+    /// Nodes added after the tree was built are held in m_extra_nodes.
+    struct forest_tree {
+        detail::nanoflann_dataset<Traits> m_dataset;
+        kd_tree_type m_kd_tree;
+        std::deque<node_type> m_extra_nodes;
+        size_t m_begin;
+        size_t m_end;
+        size_t m_n_built;
+        size_t m_n_copied;
+
+        forest_tree():
+            m_kd_tree(dimension,m_dataset),
+            m_begin(0),m_end(0),m_n_built(0),m_n_copied(0)
+        {}
+
+        node_type* get_root_node() {
+            return m_kd_tree.get_root_node();
+        }
+
+        // true once half of the points have been copied in or deleted
+        bool needs_rebuild() const {
+            return 2*(m_n_copied + m_n_built - (m_end-m_begin)) > m_n_built;
+        }
+    };
+
 
 public:
 
     nanoflann_adaptor():
-        base_type(), 
-        m_kd_tree(dimension,*this) 
+        base_type(),
+        m_next_index(0)
     {}
 
-    //~nanoflann_adaptor() {}
-
-
     static constexpr bool cheap_copy_and_delete_at_end() {
-        return false;
-    }
-
-    // Must return the number of data points
-	inline size_t kdtree_get_point_count() const { 
-        return std::distance(this->m_particles_begin,this->m_particles_end);
-    }
-
-	// Returns the distance between the vector "p1[0:size-1]" 
-    // and the data point with index "idx_p2" stored in the class:
-	inline double kdtree_distance(const double *p1, const size_t idx_p2,size_t /*size*/) const
-	{
-        size_t ret = 0;
-        const double_d& p2 = *(get<position>(this->m_particles_begin)+idx_p2);
-        for (int i = 0; i < dimension; ++i) {
-           ret += (p1[i]-p2[i])*(p1[i]-p2[i]); 
-        }
-		return ret;
-	}
-
-	// Returns the dim'th component of the idx'th point in the class:
-	// Since this is inlined and the "dim" argument is typically an immediate value, the
-	//  "if/else's" are actually solved at compile time.
-	inline double kdtree_get_pt(const size_t idx, int dim) const
-	{
-        const double_d& p = *(get<position>(this->m_particles_begin)+idx);
-        return p[dim];
-	}
-
-	// Optional bounding-box computation: return false to default to a standard bbox computation loop.
-	//   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
-	//   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
-	template <class BBOX>
-	bool kdtree_get_bbox(BBOX& bb) const { 
-        for (int i = 0; i < dimension; ++i) {
-            bb[i].low = this->m_bounds.bmin[i];
-            bb[i].high = this->m_bounds.bmax[i];
-        }
-	    return true;
+        return true;
     }
 
 private:
     void set_domain_impl() {
-        m_kd_tree.set_leaf_max_size(this->m_n_particles_in_leaf);
-
         this->m_query.m_bounds.bmin = this->m_bounds.bmin;
         this->m_query.m_bounds.bmax = this->m_bounds.bmax;
         this->m_query.m_periodic = this->m_periodic;
@@ -226,37 +280,215 @@ private:
 
 
     void embed_points_impl() {
-	    m_kd_tree.buildIndex();
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        m_trees.clear();
+        m_next_index = 0;
+        if (n > 0) {
+            m_trees.push_back(build_tree(0,n));
+        }
+        link_trees();
+    }
 
-        detail::reorder_destructive(
-                m_kd_tree.get_vind().begin(), 
-                m_kd_tree.get_vind().end(), 
-                this->m_particles_begin);
 
+    void add_points_at_end_impl(const size_t dist) {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        size_t begin = n - dist;
+        while (!m_trees.empty() 
+                && m_trees.back()->m_end - m_trees.back()->m_begin <= n - begin) {
+            begin = m_trees.back()->m_begin;
+            m_trees.pop_back();
+        }
+        m_trees.push_back(build_tree(begin,n));
+        link_trees();
+    }
+
+    void delete_points_at_end_impl(const size_t dist) {
+        const size_t n = this->m_particles_end - this->m_particles_begin;
+        while (!m_trees.empty() && m_trees.back()->m_begin >= n) {
+            m_trees.pop_back();
+        }
+        if (!m_trees.empty() && m_trees.back()->m_end > n) {
+            for (size_t i = n; i < m_trees.back()->m_end; ++i) {
+                node_type& leaf = *m_leaf_of[i];
+                leaf.node_type.lr.left = std::min<size_t>(leaf.node_type.lr.left,n);
+                leaf.node_type.lr.right = std::min<size_t>(leaf.node_type.lr.right,n);
+            }
+            m_trees.back()->m_end = n;
+        }
+        for (std::shared_ptr<forest_tree>& tree: m_trees) {
+            if (tree->needs_rebuild()) {
+                tree = build_tree(tree->m_begin,tree->m_end);
+            }
+        }
+        link_trees();
+    }
+
+    void copy_points_impl(iterator copy_from_iterator, iterator copy_to_iterator) {
+        const size_t toi = std::distance(this->m_particles_begin,copy_to_iterator);
+        auto tree_it = std::upper_bound(m_trees.begin(),m_trees.end(),toi,
+                [](const size_t i, const std::shared_ptr<forest_tree>& tree) {
+                    return i < tree->m_begin;
+                });
+        ASSERT(tree_it != m_trees.begin(),"copy to iterator is not in a tree");
+        forest_tree& tree = **(--tree_it);
+
+        // take toi out of its leaf, splitting the leaf if toi is in the middle
+        node_type& leaf = *m_leaf_of[toi];
+        const size_t left = leaf.node_type.lr.left;
+        const size_t right = leaf.node_type.lr.right;
+        if (toi == left) {
+            leaf.node_type.lr.left = toi+1;
+        } else if (toi+1 == right) {
+            leaf.node_type.lr.right = toi;
+        } else {
+            node_type& low = new_leaf(tree,left,toi);
+            node_type& high = new_leaf(tree,toi+1,right);
+            make_join(leaf,&low,&high);
+        }
 
-        this->m_query.m_root = m_kd_tree.get_root_node();
-        this->m_query.m_dummy_root.child1 = this->m_query.m_root;
-        this->m_query.m_dummy_root.child2 = this->m_query.m_root;
-        this->m_query.m_dummy_root.node_type.sub.divfeat = 0;
-        this->m_query.m_dummy_root.node_type.sub.divlow = this->m_query.m_bounds.bmin[0];
-        this->m_query.m_dummy_root.node_type.sub.divhigh = this->m_query.m_bounds.bmin[0];
-        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
-        this->m_query.m_number_of_buckets = m_kd_tree.size_nodes();
+        // give toi a leaf of its own under the leaf that contains its position
+        node_type& containing = *find_leaf(tree.get_root_node(),get<position>(*copy_to_iterator));
+        node_type& moved = new_leaf(tree,containing.node_type.lr.left,
+                                         containing.node_type.lr.right);
+        node_type& single = new_leaf(tree,toi,toi+1);
+        make_join(containing,&moved,&single);
+
+        ++tree.m_n_copied;
+        this->m_query.m_partitioned = false;
+    }
+
+    /// adds a leaf holding the particles from \p begin to \p end to \p tree
+    node_type& new_leaf(forest_tree& tree, const size_t begin, const size_t end) {
+        tree.m_extra_nodes.emplace_back();
+        node_type& leaf = tree.m_extra_nodes.back();
+        leaf.child1 = nullptr;
+        leaf.child2 = nullptr;
+        leaf.node_type.lr.left = begin;
+        leaf.node_type.lr.right = end;
+        leaf.index = m_next_index++;
+        for (size_t i = begin; i < end; ++i) {
+            m_leaf_of[i] = &leaf;
+        }
+        return leaf;
+    }
 
-        print_tree(m_kd_tree.get_root_node());
+    /// turns \p node into a node that does not split its box between its 
+    /// children \p child1 and \p child2
+    void make_join(node_type& node, node_type* child1, node_type* child2) {
+        node.child1 = child1;
+        node.child2 = child2;
+        node.node_type.sub.divfeat = 0;
+        node.node_type.sub.divlow = this->m_bounds.bmax[0];
+        node.node_type.sub.divhigh = this->m_bounds.bmin[0];
     }
 
+    /// finds a leaf of \p node whose box contains \p p. Joins are followed
+    /// into their first child
+    static node_type* find_leaf(node_type* node, const double_d& p) {
+        while (node->child1 != nullptr) {
+            const int j = node->node_type.sub.divfeat;
+            node = p[j] <= node->node_type.sub.divlow ? node->child1 : node->child2;
+        }
+        return node;
+    }
+
+    /// builds a kd-tree over the particles from \p begin to \p end, 
+    /// reordering them so that the leaves are contiguous ranges
+    std::shared_ptr<forest_tree> build_tree(const size_t begin, const size_t end) {
+        std::shared_ptr<forest_tree> tree = std::make_shared<forest_tree>();
+        tree->m_begin = begin;
+        tree->m_end = end;
+        tree->m_n_built = end-begin;
+        tree->m_dataset.m_positions = &get<position>(this->m_particles_begin)[begin];
+        tree->m_dataset.m_size = end-begin;
+        tree->m_dataset.m_bounds = this->m_bounds;
+        tree->m_kd_tree.set_leaf_max_size(this->m_n_particles_in_leaf);
+        tree->m_kd_tree.buildIndex();
 
-    void add_points_at_end_impl(const size_t dist) {
-        embed_points_impl();
+        detail::reorder_destructive(
+                tree->m_kd_tree.get_vind().begin(), 
+                tree->m_kd_tree.get_vind().end(), 
+                this->m_particles_begin+begin);
+
+        if (m_leaf_of.size() < end) {
+            m_leaf_of.resize(end);
+        }
+        if (tree->get_root_node() != nullptr) {
+            offset_nodes(tree->get_root_node(),begin);
+        }
+        return tree;
+    }
+
+    /// makes the leaf ranges of a new tree index all the particles, and 
+    /// gives its nodes indices that are unique over the forest
+    void offset_nodes(node_type* node, const size_t begin) {
+        node->index = m_next_index++;
+        if (this->m_query.is_leaf_node(*node)) {
+            node->node_type.lr.left += begin;
+            node->node_type.lr.right += begin;
+            for (size_t i = node->node_type.lr.left; i < node->node_type.lr.right; ++i) {
+                m_leaf_of[i] = node;
+            }
+        } else {
+            offset_nodes(node->child1,begin);
+            offset_nodes(node->child2,begin);
+        }
     }
 
-    void delete_points_at_end_impl(const size_t dist) {
-        embed_points_impl();
+    void renumber_nodes(node_type* node) {
+        node->index = m_next_index++;
+        if (!this->m_query.is_leaf_node(*node)) {
+            renumber_nodes(node->child1);
+            renumber_nodes(node->child2);
+        }
     }
 
-    void copy_points_impl(iterator copy_from_iterator, iterator copy_to_iterator) {
-        embed_points_impl();
+    /// joins the trees of the forest into the tree seen by the query. Node 
+    /// indices freed by rebuilt trees are reclaimed once they are the 
+    /// majority.
+    void link_trees() {
+        size_t n_nodes = 0;
+        for (const std::shared_ptr<forest_tree>& tree: m_trees) {
+            n_nodes += tree->m_kd_tree.size_nodes() + tree->m_extra_nodes.size();
+        }
+        const size_t n_joins = m_trees.empty() ? 0 : m_trees.size()-1;
+        m_joins.resize(n_joins);
+
+        node_type* root = m_trees.empty() ? nullptr : m_trees.back()->get_root_node();
+        for (int i = static_cast<int>(n_joins)-1; i >= 0; --i) {
+            make_join(m_joins[i],m_trees[i]->get_root_node(),root);
+            m_joins[i].index = m_next_index++;
+            root = &m_joins[i];
+        }
+        if (root != nullptr && m_next_index > 2*(n_nodes+n_joins)) {
+            m_next_index = 0;
+            renumber_nodes(root);
+        }
+
+        this->m_query.m_root = root;
+        this->m_query.m_dummy_root.child1 = root;
+        this->m_query.m_dummy_root.child2 = root;
+        this->m_query.m_dummy_root.node_type.sub.divfeat = 0;
+        this->m_query.m_dummy_root.node_type.sub.divlow = this->m_query.m_bounds.bmin[0];
+        this->m_query.m_dummy_root.node_type.sub.divhigh = this->m_query.m_bounds.bmin[0];
+        this->m_query.m_particles_begin = iterator_to_raw_pointer(this->m_particles_begin);
+        this->m_query.m_number_of_buckets = m_next_index;
+        this->m_query.m_adaptor = this;
+        this->m_query.m_partitioned = m_trees.size() <= 1 
+                                && (m_trees.empty() || m_trees[0]->m_n_copied == 0);
+
+        if (root != nullptr) {
+            print_tree(root);
+        }
+    }
+
+    /// embeds the points into a single tree if the leaves of the forest no
+    /// longer partition the domain, see nanoflann_adaptor_query::partition()
+    void partition() {
+        if (!this->m_query.m_partitioned) {
+            LOG(2,"nanoflann_adaptor: partition: embedding the points into a single tree");
+            embed_points_impl();
+        }
     }
 
     const nanoflann_adaptor_query<Traits>& get_query_impl() const {
@@ -264,7 +496,10 @@ private:
     }
 
 
-    kd_tree_type m_kd_tree;
+    std::vector<std::shared_ptr<forest_tree>> m_trees;
+    std::vector<node_type> m_joins;
+    std::vector<node_type*> m_leaf_of;
+    size_t m_next_index;
     nanoflann_adaptor_query<Traits> m_query;
 };
 
@@ -428,10 +663,29 @@ struct nanoflann_adaptor_query {
     detail::bbox<dimension> m_bounds;
     raw_pointer m_particles_begin;
     size_t m_number_of_buckets;
+    bool m_partitioned;
+    nanoflann_adaptor<Traits>* m_adaptor;
 
     value_type* m_root;
     value_type m_dummy_root;
 
+    nanoflann_adaptor_query():
+        m_number_of_buckets(0),
+        m_partitioned(true),
+        m_adaptor(nullptr),
+        m_root(nullptr)
+    {}
+
+    /// rebuilds the tree if points have been added or deleted since the
+    /// points were last embedded, so that its leaves partition the domain.
+    /// This reorders the particles, and invalidates iterators and buckets
+    /// obtained from the query before.
+    void partition() const {
+        if (!m_partitioned) {
+            m_adaptor->partition();
+        }
+    }
+
     const box_type& get_bounds() const { return m_bounds; }
     const bool_d& get_periodic() const { return m_periodic; }
 
@@ -541,6 +795,7 @@ struct nanoflann_adaptor_query {
 
     CUDA_HOST_DEVICE
     void get_bucket(const double_d &position, pointer& bucket, box_type& bounds) const {
+        partition();
         child_iterator i = get_children();
         i.go_to(position);
         
@@ -596,6 +851,7 @@ struct nanoflann_adaptor_query {
     }
 
     iterator_range<all_iterator> get_subtree() const {
+        partition();
         return iterator_range<all_iterator>(all_iterator(get_children(),this),all_iterator());
     }
 
@@ -184,6 +184,25 @@ public:
 
     }
 
+    /// update the search after the positions of the points from \p begin to
+    /// \p end have changed (but no points were added or removed since the 
+    /// last call to embed_points() or update_positions()). Returns the number
+    /// of points that have moved to a different bucket, which is all of them
+    /// for searches that do not support an incremental update (these 
+    /// re-embed all the points)
+    /// \see embed_points()
+    size_t update_positions(iterator begin, iterator end) {
+        m_particles_begin = begin;
+        m_particles_end = end;
+
+        CHECK(!m_bounds.is_empty(), "trying to embed particles into an empty domain. use the function `set_domain` to setup the spatial domain first.");
+
+        const size_t n = m_particles_end - m_particles_begin;
+	    LOG(2,"neighbour_search_base: update_positions: updating "<<n<<" points");
+
+        return cast().update_positions_impl();
+    }
+
     void update_iterators(iterator begin, iterator end) {
         m_particles_begin = begin;
         m_particles_end = end;
@@ -251,6 +270,11 @@ public:
     const bool_d& get_periodic() const { return m_periodic; }
 
 protected:
+    size_t update_positions_impl() {
+        cast().embed_points_impl();
+        return m_particles_end - m_particles_begin;
+    }
+
     iterator m_particles_begin;
     iterator m_particles_end;
     bool_d m_periodic;
@@ -107,10 +107,7 @@ private:
          * 3. Classify points                     *
          ******************************************/
 
-        detail::transform(get<position>(this->m_particles_begin), 
-                get<position>(this->m_particles_end), 
-                m_tags.begin(), 
-                classify_point(this->m_bounds, m_max_level));
+        classify_points(0);
 
         // Now that we have the geometric information, we can sort the
         // points accordingly.
@@ -134,17 +131,12 @@ private:
 
     void add_points_at_end_impl(const size_t dist) {
         const size_t num_points  = this->m_particles_end - this->m_particles_begin;
-        auto start_adding_particles = this->m_particles_end-dist;
         m_tags.resize(num_points);
-        auto start_adding_tags = this->m_tags.end()-dist;
 
         /******************************************
          * 3. Classify new points                 *
          ******************************************/
-        detail::transform(get<position>(start_adding_particles), 
-                get<position>(this->m_particles_end), 
-                start_adding_tags, 
-                classify_point(this->m_bounds, m_max_level));
+        classify_points(num_points-dist);
 
         // sort and then build tree
         sort_by_tags();
@@ -191,6 +183,25 @@ private:
         return this->m_query;
     }
 
+    // set the tags of the points from index \p first onwards. The tag of a 
+    // point is the Morton code of its leaf at level m_max_level
+    void classify_points(const size_t first) {
+        const size_t num_points = this->m_particles_end - this->m_particles_begin;
+#ifdef __aboria_use_thrust_algorithms__
+        detail::transform(get<position>(this->m_particles_begin) + first, 
+                get<position>(this->m_particles_end), 
+                m_tags.begin() + first, 
+                classify_point(this->m_bounds, m_max_level));
+#else
+        auto positions = get<position>(this->m_particles_begin);
+        classify_point classify(this->m_bounds, m_max_level);
+        #pragma omp parallel for
+        for (size_t i = first; i < num_points; ++i) {
+            m_tags[i] = classify(positions[i]);
+        }
+#endif
+    }
+
     void sort_by_tags() {
         /******************************************
          * 4. Sort according to classification    *
@@ -198,10 +209,8 @@ private:
         if (m_tags.size() > 0) {
             m_indices.resize(m_tags.size());
             detail::sequence(m_indices.begin(), m_indices.end());
-            detail::sort_by_key(m_tags.begin(), m_tags.end(), m_indices.begin());
-            detail::reorder_destructive(m_indices.begin(), 
-                                        m_indices.end(), 
-                                        this->m_particles_begin);
+            detail::radix_sort_by_key(m_tags.begin(), m_tags.end(), m_indices.begin());
+            detail::reorder(m_indices.begin(), m_indices.end(), this->m_particles_begin);
         }
     }
 private:
@@ -216,8 +225,8 @@ private:
     int max_points;
     int m_max_level;
 
-    vector_int m_tags;
-    vector_int m_indices;
+    vector_unsigned_int m_tags;
+    vector_unsigned_int m_indices;
     vector_int m_nodes;
     vector_int2 m_leaves;
 
@@ -226,6 +235,7 @@ private:
 
 
 
+#ifdef __aboria_use_thrust_algorithms__
 template <typename traits>
 void octtree<traits>::build_tree() {
     m_nodes.clear();
@@ -391,6 +401,149 @@ void octtree<traits>::build_tree() {
 
 
 }
+#else
+
+// On the host the tree is built one level at a time as above, but each active
+// node carries the range of sorted points that it holds, so that its children
+// are found by splitting that range on their Morton tags rather than by
+// searching all the points. Each level makes two passes over the active nodes
+// with the same static schedule: the first classifies the children and counts
+// the nodes and leaves found by each thread, and the second writes them to
+// m_nodes and m_leaves at the offsets given by a scan over these counts. The
+// nodes and leaves end up in the same order as the thrust build above.
+template <typename traits>
+void octtree<traits>::build_tree() {
+    m_nodes.clear();
+    m_leaves.clear();
+    std::vector<int> active_tags(1,0);
+    std::vector<int2> active_ranges(1,int2(0,m_tags.size()));
+    std::vector<int> child_node_kind;
+    std::vector<int2> child_ranges;
+    std::vector<int> next_active_tags;
+    std::vector<int2> next_active_ranges;
+    std::vector<int> counts;
+
+    LOG(4,"octree: building tree with max_level = "<<m_max_level);
+
+    const unsigned int* tags = iterator_to_raw_pointer(m_tags.begin());
+    const int threshold = this->m_n_particles_in_leaf;
+
+    for (int level = 1 ; !active_tags.empty(); ++level) {
+
+        ASSERT(level <= m_max_level, "octtree build_tree: tree has exceeded max levels");
+
+        const int num_active = active_tags.size();
+        const int shift = (m_max_level - level) * dimension;
+        const bool last_level = level == m_max_level;
+        child_node_kind.resize(nchild*num_active);
+        child_ranges.resize(nchild*num_active);
+
+        #pragma omp parallel
+        {
+#ifdef HAVE_OPENMP
+            const int nthreads = omp_get_num_threads();
+            const int thread = omp_get_thread_num();
+#else
+            const int nthreads = 1;
+            const int thread = 0;
+#endif
+            #pragma omp single
+            counts.assign(2*(nthreads+1),0);
+
+            /******************************************
+             * 1. Classify children                   *
+             ******************************************/
+
+            int num_nodes = 0;
+            int num_leaves = 0;
+            #pragma omp for schedule(static)
+            for (int i = 0; i < num_active; ++i) {
+                int begin = active_ranges[i][0];
+                const int end = active_ranges[i][1];
+                for (int j = 0; j < nchild; ++j) {
+                    const unsigned int child_end_tag = 
+                        active_tags[i] + ((j + 1u) << shift);
+                    const int child_end = std::lower_bound(tags + begin, 
+                                                           tags + end,
+                                                           child_end_tag) - tags;
+                    const int count = child_end - begin;
+                    int kind;
+                    if (count == 0) {
+                        kind = detail::EMPTY;
+                    } else if (last_level || count <= threshold) {
+                        kind = detail::LEAF;
+                        ++num_leaves;
+                    } else {
+                        kind = detail::NODE;
+                        ++num_nodes;
+                    }
+                    child_node_kind[nchild*i + j] = kind;
+                    child_ranges[nchild*i + j] = int2(begin,child_end);
+                    begin = child_end;
+                }
+            }
+            counts[2*(thread+1)] = num_nodes;
+            counts[2*(thread+1) + 1] = num_leaves;
+
+            /******************************************
+             * 2. Enumerate nodes and leaves          *
+             ******************************************/
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                for (int t = 0; t < nthreads; ++t) {
+                    counts[2*(t+1)] += counts[2*t];
+                    counts[2*(t+1) + 1] += counts[2*t + 1];
+                }
+                next_active_tags.resize(counts[2*nthreads]);
+                next_active_ranges.resize(counts[2*nthreads]);
+                m_nodes.resize(m_nodes.size() + nchild*num_active);
+                m_leaves.resize(m_leaves.size() + counts[2*nthreads + 1]);
+            }
+
+            /******************************************
+             * 3. Add the children to the node list   *
+             *    and the leaves to the leaf list     *
+             ******************************************/
+
+            const int children_begin = m_nodes.size() - nchild*num_active;
+            const int next_children_begin = m_nodes.size();
+            const int leaves_begin = m_leaves.size() - counts[2*nthreads + 1];
+            int node_idx = counts[2*thread];
+            int leaf_idx = leaves_begin + counts[2*thread + 1];
+            #pragma omp for schedule(static)
+            for (int i = 0; i < num_active; ++i) {
+                for (int j = 0; j < nchild; ++j) {
+                    const int child = nchild*i + j;
+                    switch (child_node_kind[child]) {
+                        case detail::EMPTY:
+                            m_nodes[children_begin + child] = detail::get_empty_id();
+                            break;
+                        case detail::LEAF:
+                            m_nodes[children_begin + child] = detail::get_leaf_id(leaf_idx);
+                            m_leaves[leaf_idx++] = child_ranges[child];
+                            break;
+                        case detail::NODE:
+                            m_nodes[children_begin + child] = 
+                                next_children_begin + nchild*node_idx;
+                            next_active_tags[node_idx] = active_tags[i] | (j << shift);
+                            next_active_ranges[node_idx++] = child_ranges[child];
+                            break;
+                    }
+                }
+            }
+        }
+
+        /******************************************
+         * 4. Set the nodes for the next level    *
+         ******************************************/
+
+        active_tags.swap(next_active_tags);
+        active_ranges.swap(next_active_ranges);
+    }
+}
+#endif
 
 // Classify a point with respect to the bounding box.
 template <typename traits>
@@ -313,13 +313,59 @@ public:
         this->push_back(i);
     }
 
-    /// push the particles in \p particles to the back of the container
+    /// push the particles in \p particles to the back of the container (the
+    /// ones within the searchable domain). The container is resized once and
+    /// the neighbourhood search is updated once for all the new particles
     void push_back (const particles_type& particles) {
-        for (const value_type& i: particles) {
-            this->push_back(i,false);
+        const size_t old_size = size();
+        resize(old_size + particles.size());
+        for (size_t index = 0; index < particles.size(); ++index) {
+            *(begin() + old_size + index) = particles[index];
         }
+        add_points_at_end(old_size);
+    }
+
+    /// grow the container to \p n particles, without updating the 
+    /// neighbourhood search. The variables of the new particles can then be
+    /// set directly (e.g. a whole column at once), before they are added 
+    /// with add_points_at_end()
+    void resize(const size_t n) {
+        CHECK(n >= size(), "resize can only grow the container, use pop_back() or delete_particles() to remove particles");
+        traits_type::resize(data,n);
+    }
+
+    /// add the particles from \p old_size to the end of the container (the
+    /// ones within the searchable domain), after a call to resize(). They
+    /// are given new ids and random seeds, and the neighbourhood search is 
+    /// updated once for all of them
+    void add_points_at_end(const size_t old_size) {
+        const size_t n = size();
+        size_t new_size = old_size;
+        for (size_t index = old_size; index < n; ++index) {
+            reference i = *(begin() + new_size);
+            if (index != new_size) {
+                i = *(begin() + index);
+            }
+            Aboria::get<alive>(i) = true;
+            if (searchable) {
+                detail::enforce_domain_impl<traits_type::dimension,reference> enforcer(search.get_min(),search.get_max(),search.get_periodic());
+                enforcer(i);
+            }
+            if (Aboria::get<alive>(i)) {
+                Aboria::get<id>(i) = this->next_id++;
+                Aboria::get<random>(i).seed(seed + uint32_t(Aboria::get<id>(i)));
+                ++new_size;
+            } else {
+                LOG(2,"WARNING: particle you tried to push back with r = "<<Aboria::get<position>(i)<<" is outside the domain and has been removed");
+            }
+        }
+        traits_type::resize(data,new_size);
         if (searchable) {
-            search.add_points_at_end(data.begin(),data.end()-particles.size(),data.end());
+            if (new_size > old_size) {
+                search.add_points_at_end(begin(),begin()+old_size,end());
+            } else {
+                search.update_iterators(begin(),end());
+            }
         }
     }
 
@@ -470,6 +516,11 @@ public:
         searchable = true;
     }
 
+    /// return true if init_neighbour_search() has been called
+    bool is_searchable() const {
+        return searchable;
+    }
+
     const query_type& get_query() const {
         ASSERT(searchable,"init_neighbour_search not called on this particle set");
         return search.get_query();
@@ -531,11 +582,50 @@ public:
     /// Update the neighbourhood search data. This function must be
     /// called after altering the particle positions (e.g. with 
     /// `set<position>(particle,new_position)`) in order for accurate
-    /// neighbourhood searching
+    /// neighbourhood searching. Particles outside a non-periodic domain are
+    /// deleted and the rest are updated incrementally if the search supports
+    /// it (see neighbour_search_base::update_positions()).
+    /// \return the number of particles that moved to a different bucket
     /// \see get_neighbours()
-    void update_positions() {
-        if (searchable) {
-            enforce_domain(search.get_min(),search.get_max(),search.get_periodic());
+    size_t update_positions() {
+        if (!searchable) return 0;
+        const bool_d& periodic = search.get_periodic();
+        detail::for_each(begin(), end(),
+                detail::enforce_domain_impl<traits_type::dimension,reference>(
+                    search.get_min(),search.get_max(),periodic));
+        if ((periodic==false).any()) {
+            // searches that cannot delete points cheaply are rebuilt below
+            delete_particles(search.cheap_copy_and_delete_at_end());
+        }
+        return search.update_positions(begin(),end());
+    }
+
+    /// Reorders the particles along a Z-order (Morton) curve through the 
+    /// search domain, so that particles close to each other in space are 
+    /// also close in memory, which makes neighbourhood searches more cache
+    /// friendly. The particles keep their ids, but this invalidates any 
+    /// iterators or indices into the container. Does nothing if 
+    /// init_neighbour_search() has not been called
+    void reorder_morton() {
+        if (!searchable) return;
+        const size_t n = size();
+        LOG(2,"Particle: reorder_morton: reordering "<<n<<" particles");
+        detail::bbox<dimension> bounds(search.get_min(),search.get_max());
+        std::vector<uint64_t> keys(n);
+        std::vector<unsigned int> order(n);
+        #pragma omp parallel for
+        for (size_t i=0; i<n; ++i) {
+            keys[i] = detail::morton_code(
+                    static_cast<const double_d&>(Aboria::get<position>(data)[i]),bounds);
+        }
+        detail::sequence(order.begin(),order.end());
+        detail::radix_sort_by_key(keys.begin(),keys.end(),order.begin());
+        detail::reorder(order.begin(),order.end(),begin());
+        search.embed_points(begin(),end());
+        if (!id_to_index.empty()) {
+            for (size_t i=0; i<n; ++i) {
+                id_to_index[Aboria::get<id>(data)[i]] = i;
+            }
         }
     }
 
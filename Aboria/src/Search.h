@@ -98,11 +98,19 @@ public:
     typedef const tuple_ns::tuple<p_reference,const double_d&> value_type;
 	typedef std::ptrdiff_t difference_type;
 
-    static iterator_range<periodic_iterator_type> get_periodic_range(const bool_d is_periodic) {
+    // the periodic images of the query point \p r that can have points 
+    // within \p max_distance. The image shifted down by one domain width is 
+    // only needed if r is within max_distance of the upper face, and 
+    // similarly for the image shifted up, so usually only the original 
+    // point is searched
+    static iterator_range<periodic_iterator_type> get_periodic_range(const bool_d is_periodic,
+                                                        const double_d& r,
+                                                        const double max_distance,
+                                                        const detail::bbox<dimension>& bounds) {
         int_d start,end;
         for (int i = 0; i < dimension; ++i) {
-           start[i] = is_periodic[i] ? -1 : 0;  
-           end[i] =   is_periodic[i] ?  2 : 1;  
+           start[i] = is_periodic[i] && r[i]+max_distance >= bounds.bmax[i] ? -1 : 0;  
+           end[i] =   is_periodic[i] && r[i]-max_distance <= bounds.bmin[i] ?  2 : 1;  
         }
         return iterator_range<periodic_iterator_type>(
                 periodic_iterator_type(start,end),
@@ -123,7 +131,8 @@ public:
         m_query(&query),
         m_max_distance(max_distance),
         m_max_distance2(detail::distance_helper<LNormNumber>::get_value_to_accumulate(max_distance)),
-        m_periodic(get_periodic_range(m_query->get_periodic())),
+        m_periodic(get_periodic_range(m_query->get_periodic(),r,max_distance,
+                                      m_query->get_bounds())),
         m_current_periodic(m_periodic.begin()),
         m_current_point(r+(*m_current_periodic)
                             *(m_query->get_bounds().bmax-m_query->get_bounds().bmin)),
@@ -359,6 +368,155 @@ distance_search(const Query& query,
             );
 }
 
+/// Calls `f(index, dx, r2)` for every point within \p max_distance of
+/// \p centre, using the LNormNumber norm (Euclidean by default). `index` is
+/// the index of the point in the particle set, `dx` the separation from
+/// \p centre to the point (or its nearest periodic image) and `r2` the
+/// accumulated norm of `dx`, i.e. the squared distance for the Euclidean
+/// norm. This finds the same points as distance_search, but loops over the
+/// periodic images, buckets and points directly rather than through a
+/// search_iterator, which lets the compiler inline \p f into a tight loop.
+template<int LNormNumber=2, typename Query, typename F>
+void for_each_neighbour(const Query& query,
+                        const typename Query::double_d& centre,
+                        const double max_distance,
+                        F f) {
+    typedef typename Query::double_d double_d;
+    typedef typename Query::traits_type::position position;
+    typedef detail::distance_helper<LNormNumber> distance;
+    const unsigned int D = Query::dimension;
+
+    const detail::bbox<D>& bounds = query.get_bounds();
+    const double_d width = bounds.bmax-bounds.bmin;
+    const double max_distance2 = distance::get_value_to_accumulate(max_distance);
+    const double_d* x = get<position>(query.get_particles_begin());
+    for (const auto& image: search_iterator<Query,LNormNumber>::get_periodic_range(
+                                query.get_periodic(),centre,max_distance,bounds)) {
+        const double_d point = centre + image*width;
+        for (const auto& bucket: query.get_buckets_near_point(point,max_distance)) {
+            for (const auto& p: query.get_bucket_particles(bucket)) {
+                const size_t index = &get<position>(p) - x;
+                double_d dx;
+                double r2 = 0;
+                for (int d = 0; d < D; ++d) {
+                    dx[d] = x[index][d] - point[d];
+                    r2 = distance::accumulate_norm(r2,dx[d]);
+                }
+                if (r2 <= max_distance2) {
+                    f(index,dx,r2);
+                }
+            }
+        }
+    }
+}
+
+
+/// Calls `f(particles_i, particles_j, shift, self)` for each bucket j of the
+/// bucket search \p query (bucket_search_serial, bucket_search_parallel or 
+/// bucket_search_hash) that can hold points within \p max_distance of the
+/// points in \p bucket. `particles_i` and `particles_j` are the ranges of 
+/// points in the two buckets, and `shift` is the periodic shift to add to the 
+/// positions of the points in bucket j, so the separation of point a in 
+/// bucket i and point b in bucket j is `get<position>(b)+shift-get<position>(a)`.
+/// Empty buckets are skipped.
+///
+/// The bucket pairs are found from a stencil of bucket offsets, without
+/// searching around every point. If \p half is set, only the half of the
+/// stencil with lexicographically positive offsets is visited, as well as
+/// bucket i itself with `self` set (`particles_j == particles_i`, and only
+/// the pairs of different points should be used, once each). Visiting every
+/// bucket in this way gives each unordered pair of points within
+/// \p max_distance once, which is useful for symmetric interactions.
+///
+/// The ranges are contiguous blocks of particles for bucket_search_parallel,
+/// which sorts the particles by bucket, but walk the linked list of the
+/// bucket for bucket_search_serial and bucket_search_hash. The stencil is
+/// pruned with the Euclidean distance between buckets. The sparse sums of
+/// the symbolic API (`AccumulateWithinDistance`) still search around each
+/// particle with for_each_neighbour(), since they are evaluated one particle
+/// at a time and can use other norms.
+template<typename Query, typename F>
+void for_each_bucket_pair(const Query& query, 
+                          const typename Query::int_d& bucket,
+                          const double max_distance,
+                          F f,
+                          const bool half=false) {
+    typedef typename Query::double_d double_d;
+    typedef typename Query::bool_d bool_d;
+    typedef typename Query::int_d int_d;
+    const unsigned int D = Query::dimension;
+
+    auto particles_i = query.get_bucket_particles(bucket);
+    if (particles_i.begin() == particles_i.end()) return;
+
+    const auto& bounds = query.get_bounds();
+    const bool_d& periodic = query.get_periodic();
+    const double_d width = bounds.bmax-bounds.bmin;
+    const auto bucket_bounds = query.get_bucket_bbox(bucket);
+    const double_d side = bucket_bounds.bmax-bucket_bounds.bmin;
+    int_d size,reach;
+    for (int d=0; d<D; ++d) {
+        size[d] = std::round(width[d]/side[d]);
+        reach[d] = std::ceil(max_distance/side[d]);
+    }
+
+    const double max_distance2 = max_distance*max_distance;
+    for (lattice_iterator<D> offset(-reach,reach+1); offset != false; ++offset) {
+        // half stencil: skip the offsets that are lexicographically negative
+        bool self = true;
+        bool negative = false;
+        for (int d=0; d<D; ++d) {
+            if ((*offset)[d] != 0) {
+                self = false;
+                negative = (*offset)[d] < 0;
+                break;
+            }
+        }
+        if (half && negative) continue;
+
+        // skip the buckets that are too far away (the stencil is a sphere)
+        double r2 = 0;
+        for (int d=0; d<D; ++d) {
+            const double gap = (std::abs((*offset)[d])-1)*side[d];
+            if (gap > 0) r2 += gap*gap;
+        }
+        if (r2 > max_distance2) continue;
+
+        // wrap the offset bucket around the periodic dimensions
+        int_d other = bucket + *offset;
+        double_d shift(0);
+        bool outside = false;
+        for (int d=0; d<D; ++d) {
+            if (other[d] < 0 || other[d] >= size[d]) {
+                if (!periodic[d]) {
+                    outside = true;
+                    break;
+                }
+                const int k = other[d] < 0 ? -((size[d]-1-other[d])/size[d]) 
+                                           : other[d]/size[d];
+                other[d] -= k*size[d];
+                shift[d] = k*width[d];
+            }
+        }
+        if (outside) continue;
+
+        auto particles_j = self ? particles_i : query.get_bucket_particles(other);
+        if (particles_j.begin() == particles_j.end()) continue;
+        f(particles_i,particles_j,shift,self);
+    }
+}
+
+/// Calls `for_each_bucket_pair(query,bucket,max_distance,f,half)` for every
+/// bucket of \p query.
+template<typename Query, typename F>
+void for_each_bucket_pair(const Query& query, 
+                          const double max_distance,
+                          F f,
+                          const bool half=false) {
+    for (const auto& bucket: query.get_subtree()) {
+        for_each_bucket_pair(query,bucket,max_distance,f,half);
+    }
+}
 
 }
 
@@ -6,6 +6,9 @@
 #include "Get.h"
 #include "Traits.h"
 #include <algorithm>
+#ifdef HAVE_OPENMP
+#include <omp.h>
+#endif
 
 
 
@@ -139,6 +142,127 @@ void sort_by_key(T1 start_keys,
 #endif
 }
 
+// stable sort of the unsigned keys from start_keys to end_keys (and the 
+// corresponding data from start_data) using a least-significant-digit radix
+// sort with 8 bits per pass, skipping the digits above the largest key. Each
+// pass builds per-thread histograms, scans them into per-thread offsets and 
+// scatters the keys into a second buffer
+template<typename T1, typename T2>
+void radix_sort_by_key(T1 start_keys,
+        T1 end_keys,
+        T2 start_data) {
+
+#ifdef __aboria_use_thrust_algorithms__
+    thrust::sort_by_key(start_keys,end_keys,start_data);
+#else
+    typedef typename std::iterator_traits<T1>::value_type key_type;
+    typedef typename std::iterator_traits<T2>::value_type data_type;
+    static_assert(std::is_unsigned<key_type>::value,"radix_sort_by_key needs unsigned keys");
+    const int radix_bits = 8;
+    const int radix = 1 << radix_bits;
+
+    const size_t n = std::distance(start_keys,end_keys);
+    if (n == 0) return;
+
+    key_type* keys_in = &start_keys[0];
+    data_type* data_in = &start_data[0];
+    key_type max_key = 0;
+    #pragma omp parallel for reduction(max:max_key)
+    for (size_t i=0; i<n; ++i) {
+        max_key = std::max(max_key,keys_in[i]);
+    }
+
+    std::vector<key_type> keys_buffer(n);
+    std::vector<data_type> data_buffer(n);
+    key_type* keys_out = keys_buffer.data();
+    data_type* data_out = data_buffer.data();
+    std::vector<size_t> counts;
+
+    int passes = 0;
+    for (int shift=0; shift < int(8*sizeof(key_type)) && (max_key >> shift) > 0; 
+                                                        shift += radix_bits) {
+        #pragma omp parallel
+        {
+#ifdef HAVE_OPENMP
+            const int nthreads = omp_get_num_threads();
+            const int thread = omp_get_thread_num();
+#else
+            const int nthreads = 1;
+            const int thread = 0;
+#endif
+            #pragma omp single
+            counts.assign(nthreads*radix,0);
+            size_t* thread_counts = counts.data() + thread*radix;
+
+            // static schedules give each thread the same keys in both loops
+            #pragma omp for schedule(static)
+            for (size_t i=0; i<n; ++i) {
+                ++thread_counts[(keys_in[i] >> shift) & (radix-1)];
+            }
+
+            #pragma omp single
+            {
+                size_t offset = 0;
+                for (int digit=0; digit<radix; ++digit) {
+                    for (int t=0; t<nthreads; ++t) {
+                        const size_t count = counts[t*radix + digit];
+                        counts[t*radix + digit] = offset;
+                        offset += count;
+                    }
+                }
+            }
+
+            #pragma omp for schedule(static)
+            for (size_t i=0; i<n; ++i) {
+                const size_t j = thread_counts[(keys_in[i] >> shift) & (radix-1)]++;
+                keys_out[j] = keys_in[i];
+                data_out[j] = data_in[i];
+            }
+        }
+        std::swap(keys_in,keys_out);
+        std::swap(data_in,data_out);
+        ++passes;
+    }
+
+    // odd number of passes leaves the result in the buffers
+    if (passes % 2 == 1) {
+        #pragma omp parallel for
+        for (size_t i=0; i<n; ++i) {
+            keys_out[i] = keys_in[i];
+            data_out[i] = data_in[i];
+        }
+    }
+#endif
+}
+
+// reorders v such that v_new[i] == v[order[i]]. With more than one thread
+// this gathers into a copy of v in parallel, otherwise it uses
+// reorder_destructive, which needs no copy
+template< typename order_iterator, typename value_iterator >
+void reorder( order_iterator order_begin, order_iterator order_end, value_iterator v )  {
+#if defined(__aboria_use_thrust_algorithms__) || !defined(HAVE_OPENMP)
+    reorder_destructive(order_begin,order_end,v);
+#else
+    typedef typename std::iterator_traits< value_iterator >::value_type value_t;
+    typedef typename std::iterator_traits< value_iterator >::reference reference;
+
+    if (omp_get_max_threads() == 1) {
+        reorder_destructive(order_begin,order_end,v);
+        return;
+    }
+    const size_t n = std::distance(order_begin,order_end);
+    std::vector<value_t> buffer(n);
+    #pragma omp parallel for
+    for (size_t i=0; i<n; ++i) {
+        buffer[i] = v[order_begin[i]];
+    }
+    #pragma omp parallel for
+    for (size_t i=0; i<n; ++i) {
+        static_cast<reference>(v[i]) = buffer[i];
+    }
+#endif
+}
+
 template<typename ForwardIterator, typename InputIterator, typename OutputIterator>
 void lower_bound(
         ForwardIterator first,
@@ -285,12 +285,13 @@ namespace detail {
             typedef fusion::list<const double_d &> list_type;
             const int LNormNumber = accumulate_type::norm_number_type::value;
 
+            // a search around ai rather than for_each_bucket_pair(), as the
+            // expression is evaluated for one particle at a time
             result_type sum = accum.init;
-            //TODO: get query range and put it in box search
-            for (const auto& i: distance_search<LNormNumber>(
-                                    particlesb.get_query(),get<position>(ai),accum.max_distance)) {
-                const_b_reference bi = std::get<0>(i);
-                const double_d& dx = std::get<1>(i);
+            for_each_neighbour<LNormNumber>(
+                    particlesb.get_query(),get<position>(ai),accum.max_distance,
+                    [&](const size_t j, const double_d& dx, const double) {
+                const_b_reference bi = particlesb[j];
 
                 EvalCtx<map_type,list_type> const new_ctx(
                         fusion::make_map<label_a_type,label_b_type>(ai,bi),
@@ -298,7 +299,7 @@ namespace detail {
                         );
 
                 sum = accum.functor(sum,proto::eval(expr,new_ctx));
-            }
+            });
             return sum;
         }
 
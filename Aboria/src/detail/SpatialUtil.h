@@ -9,6 +9,7 @@
 #include <bitset>         // std::bitset
 #include <iomanip>      // std::setw
 #include <limits>
+#include <cstdint>
 
 namespace Aboria {
 namespace detail {
@@ -235,6 +236,36 @@ struct point_to_bucket_index {
 
 
 
+// interleave the lowest 64/D (at most 32) bits of each element of \p index
+// into a Z-order (Morton) code
+template<unsigned int D>
+CUDA_HOST_DEVICE
+uint64_t morton_code(const Vector<unsigned int,D>& index) {
+    const int bits = std::min(32u,64/D);
+    uint64_t code = 0;
+    for (int b = bits-1; b >= 0; --b) {
+        for (int d = 0; d < D; ++d) {
+            code = (code << 1) | ((index[d] >> b) & 1u);
+        }
+    }
+    return code;
+}
+
+// the Z-order (Morton) code of the point \p r within the bounding box
+// \p bounds, which is divided into 2^(64/D) (at most 2^32) cells along each
+// dimension
+template<unsigned int D>
+CUDA_HOST_DEVICE
+uint64_t morton_code(const Vector<double,D>& r, const bbox<D>& bounds) {
+    const double cells = std::ldexp(1.0,std::min(32u,64/D));
+    Vector<unsigned int,D> index;
+    for (int d = 0; d < D; ++d) {
+        const double x = (r[d]-bounds.bmin[d])/(bounds.bmax[d]-bounds.bmin[d])*cells;
+        index[d] = x < 0 ? 0 : (x >= cells ? cells-1 : x);
+    }
+    return morton_code(index);
+}
+
 // Utility functions to encode leaves and children in single int
 inline CUDA_HOST_DEVICE
 bool is_empty(int id) { return id == 0xffffffff; }
@@ -271,36 +302,32 @@ struct is_a
 
 template<unsigned int D>
 CUDA_HOST_DEVICE
-int point_to_tag(const Vector<double,D> &p, bbox<D> box, int max_level) {
-    typedef Vector<double,D> double_d;
-    typedef Vector<int,D> int_d;
+int point_to_tag(const Vector<double,D> &p, const bbox<D>& box, int max_level) {
+    // b[i][0] and b[i][1] are the lower and upper bounds in the 
+    // i-direction. Each level overwrites the bound on the other side of the
+    // point to the midpoint, which avoids a hard to predict branch
+    double b[D][2];
+    for (int i=0; i<D; i++) {
+        b[i][0] = box.bmin[i];
+        b[i][1] = box.bmax[i];
+    }
+
     int result = 0;
-  
     for (int level = 1 ; level <= max_level ; ++level) {
-        double_d mid;
-        int_d hi_half;
-    
         for (int i=0; i<D; i++) {
             // Classify in i-direction
-            mid[i] = 0.5f * (box.bmin[i] + box.bmax[i]);
-            hi_half[i] = (p[i] < mid[i]) ? 0 : 1;
-  
+            const double mid = 0.5 * (b[i][0] + b[i][1]);
+            const int hi_half = (p[i] < mid) ? 0 : 1;
+
             // Push the bit into the result as we build it
-            result |= hi_half[i];
-            result <<= 1;
-        }
-  
-        // Shrink the bounding box, still encapsulating the point
-        for (int i=0; i<D; i++) {
-            box.bmin[i] = (hi_half[i]) ? mid[i] : box.bmin[i];
-            box.bmax[i] = (hi_half[i]) ? box.bmax[i] : mid[i];
-        }
+            result = (result << 1) | hi_half;
 
-  }
-  // Unshift the last
-  result >>= 1;
+            // Shrink the bounding box, still encapsulating the point
+            b[i][1-hi_half] = mid;
+        }
+    }
 
-  return result;
+    return result;
 }
 
 
@@ -370,12 +370,401 @@ For example,
         t1 = Clock::now();
         std::chrono::duration<double> dt_aboria = t1 - t0;
 
+        // Aboria search using a visitor
+        t0 = Clock::now();
+        Aboria::detail::for_each(particles.begin(),particles.end(),
+                [&](typename particles_type::reference i) {
+                    int count = 0;
+                    for_each_neighbour(particles.get_query(),get<position>(i),r,
+                        [&](const size_t j, const double_d& dx, const double dx2) {
+                            TS_ASSERT_LESS_THAN_EQUALS(dx.squaredNorm(),r2);
+                            TS_ASSERT_DELTA(dx2,dx.squaredNorm(),1e-10);
+                            TS_ASSERT_LESS_THAN(j,particles.size());
+                            count++;
+                        });
+                    TS_ASSERT_EQUALS(count,get<neighbours>(i));
+                });
+        t1 = Clock::now();
+        std::chrono::duration<double> dt_visitor = t1 - t0;
+
         std::cout << "\ttiming result: Aboria = "<<dt_aboria.count()
+                  <<" visitor = "<<dt_visitor.count()
                   <<" versus brute force = "<<dt_brute.count()<<std::endl;
     }
 
     
 
+    template<unsigned int D, 
+             template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_update_positions(const int N, const double r, const int neighbour_n, const bool is_periodic) {
+    	typedef Particles<std::tuple<>,D,VectorType,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Vector<int,D> int_d;
+    	double_d min(-1);
+    	double_d max(1);
+    	bool_d periodic(is_periodic);
+        particles_type particles(N);
+        double r2 = r*r;
+
+        std::cout << "update positions test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        std::default_random_engine gen; 
+        std::uniform_real_distribution<double> uniform(-1,1);
+        std::uniform_real_distribution<double> small(-0.01,0.01);
+        for (int i=0; i<N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+        }
+    	particles.init_neighbour_search(min,max,periodic,neighbour_n);
+
+        // move the particles a little, so that only some change bucket
+        for (int step = 0; step < 3; ++step) {
+            for (int i=0; i<particles.size(); ++i) {
+                for (int d = 0; d < D; ++d) {
+                    get<position>(particles)[i][d] += small(gen);
+                }
+            }
+            const size_t n_moved = particles.update_positions();
+            TS_ASSERT_LESS_THAN_EQUALS(n_moved,particles.size());
+            std::cout << "\tstep "<<step<<": "<<n_moved<<" of "<<particles.size()
+                      <<" particles changed bucket"<<std::endl;
+
+            for (typename particles_type::reference i: particles) {
+                int count = 0;
+                for (typename particles_type::const_reference j: particles) {
+                    const double_d& pi = get<position>(i);
+                    const double_d& pj = get<position>(j);
+                    if (is_periodic) {
+                        for (lattice_iterator<D> periodic_it(int_d(-1),int_d(2)); 
+                                periodic_it != false; ++periodic_it) {
+                            if ((pi+(*periodic_it)*(max-min)-pj).squaredNorm() <= r2) {
+                                count++;
+                            }
+                        }
+                    } else {
+                        if ((pi-pj).squaredNorm() <= r2) {
+                            count++;
+                        }
+                    }
+                }
+                int search_count = 0;
+                for (auto tpl: euclidean_search(particles.get_query(),get<position>(i),r)) {
+                    search_count++;
+                }
+                TS_ASSERT_EQUALS(search_count,count);
+            }
+        }
+    }
+
+    template<unsigned int D, 
+             template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_clustered(const int N, const double r, const int neighbour_n, const bool is_periodic) {
+    	typedef Particles<std::tuple<>,D,VectorType,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Vector<int,D> int_d;
+    	double_d min(-1000);
+    	double_d max(1000);
+    	bool_d periodic(is_periodic);
+        particles_type particles(N);
+        double r2 = r*r;
+
+        std::cout << "clustered test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        // two small clusters, one of them straddling the periodic boundary
+        unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
+        std::default_random_engine gen(seed1); 
+        std::uniform_real_distribution<double> uniform(-1,1);
+        for (int i=0; i<N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                const double x = uniform(gen);
+                get<position>(particles)[i][d] = i%2 ? 10+x : (x < 0 ? max[d]+x : min[d]+x);
+            }
+        }
+
+    	particles.init_neighbour_search(min,max,periodic,neighbour_n);
+
+        for (size_t i=0; i<particles.size(); ++i) {
+            const double_d& pi = get<position>(particles)[i];
+            int count = 0;
+            for (size_t j=0; j<particles.size(); ++j) {
+                const double_d& pj = get<position>(particles)[j];
+                if (is_periodic) {
+                    for (lattice_iterator<D> periodic_it(int_d(-1),int_d(2)); 
+                            periodic_it != false; ++periodic_it) {
+                        if ((pi+(*periodic_it)*(max-min)-pj).squaredNorm() <= r2) {
+                            count++;
+                        }
+                    }
+                } else if ((pi-pj).squaredNorm() <= r2) {
+                    count++;
+                }
+            }
+            int search_count = 0;
+            for (auto tpl: euclidean_search(particles.get_query(),pi,r)) {
+                TS_ASSERT_LESS_THAN_EQUALS(std::get<1>(tpl).squaredNorm(),r2);
+                search_count++;
+            }
+            TS_ASSERT_EQUALS(search_count,count);
+        }
+    }
+
+    template<unsigned int D,
+             template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_insert_delete(const int N, const double r, const int neighbour_n, const bool is_periodic) {
+    	typedef Particles<std::tuple<>,D,VectorType,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Vector<int,D> int_d;
+    	double_d min(-1);
+    	double_d max(1);
+    	bool_d periodic(is_periodic);
+        particles_type particles(N/2);
+        double r2 = r*r;
+
+        std::cout << "insert delete test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        unsigned seed1 = std::chrono::system_clock::now().time_since_epoch().count();
+        std::default_random_engine gen(seed1);
+        std::uniform_real_distribution<double> uniform(-1,1);
+        for (size_t i=0; i<particles.size(); ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+        }
+
+    	particles.init_neighbour_search(min,max,periodic,neighbour_n);
+
+        std::chrono::duration<double> dt_update(0);
+        for (int step=0; step<10; ++step) {
+            // add particles one at a time and as a block, and delete some
+            auto t0 = Clock::now();
+            for (int i=0; i<N/20; ++i) {
+                double_d p;
+                for (int d = 0; d < D; ++d) {
+                    p[d] = uniform(gen);
+                }
+                particles.push_back(p);
+            }
+            particles_type block(N/20);
+            for (size_t i=0; i<block.size(); ++i) {
+                for (int d = 0; d < D; ++d) {
+                    get<position>(block)[i][d] = uniform(gen);
+                }
+            }
+            particles.push_back(block);
+            for (size_t i=0; i<particles.size(); ++i) {
+                if (uniform(gen) < -0.8) {
+                    get<alive>(particles)[i] = false;
+                }
+            }
+            particles.delete_particles();
+            dt_update += Clock::now() - t0;
+
+            for (size_t i=0; i<particles.size(); ++i) {
+                const double_d& pi = get<position>(particles)[i];
+                int count = 0;
+                for (size_t j=0; j<particles.size(); ++j) {
+                    const double_d& pj = get<position>(particles)[j];
+                    if (is_periodic) {
+                        for (lattice_iterator<D> periodic_it(int_d(-1),int_d(2));
+                                periodic_it != false; ++periodic_it) {
+                            if ((pi+(*periodic_it)*(max-min)-pj).squaredNorm() <= r2) {
+                                count++;
+                            }
+                        }
+                    } else if ((pi-pj).squaredNorm() <= r2) {
+                        count++;
+                    }
+                }
+                int search_count = 0;
+                for (auto tpl: euclidean_search(particles.get_query(),pi,r)) {
+                    TS_ASSERT_LESS_THAN_EQUALS(std::get<1>(tpl).squaredNorm(),r2);
+                    search_count++;
+                }
+                TS_ASSERT_EQUALS(search_count,count);
+            }
+
+            // the bucket containing each particle can be found after
+            // adding and deleting (this can reorder the particles)
+            typedef typename particles_type::query_type query_type;
+            typename query_type::pointer bucket;
+            typename query_type::box_type box;
+            particles.get_query().get_bucket(get<position>(particles)[0],bucket,box);
+            for (size_t i=0; i<particles.size(); ++i) {
+                particles.get_query().get_bucket(get<position>(particles)[i],bucket,box);
+                bool found = false;
+                for (auto p: particles.get_query().get_bucket_particles(*bucket)) {
+                    if (&get<position>(p) == &get<position>(particles)[i]) {
+                        found = true;
+                    }
+                }
+                TS_ASSERT(found);
+            }
+        }
+        std::cout << "\ttiming result: adding and deleting = "<<dt_update.count()<<std::endl;
+    }
+
+    template<template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_test_list_clustered() {
+        helper_d_clustered<2,VectorType,SearchMethod>(1000,0.2,10,true);
+        helper_d_clustered<2,VectorType,SearchMethod>(1000,0.2,10,false);
+        helper_d_clustered<3,VectorType,SearchMethod>(1000,0.3,10,true);
+        helper_d_clustered<3,VectorType,SearchMethod>(1000,0.3,10,false);
+    }
+
+    template<unsigned int D, 
+             template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_reorder_morton(const int N, const double r, const int neighbour_n, const bool is_periodic) {
+    	typedef Particles<std::tuple<>,D,VectorType,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+    	double_d min(-1);
+    	double_d max(1);
+    	bool_d periodic(is_periodic);
+        particles_type particles(N);
+
+        std::cout << "reorder morton test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        std::default_random_engine gen; 
+        std::uniform_real_distribution<double> uniform(-1,1);
+        for (int i=0; i<N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+        }
+    	particles.init_neighbour_search(min,max,periodic,neighbour_n);
+
+        // the neighbours of each particle, by id
+        auto find_neighbours = [&]() {
+            std::map<size_t,std::multiset<size_t>> neighbours;
+            for (typename particles_type::reference i: particles) {
+                std::multiset<size_t>& ids = neighbours[get<id>(i)];
+                for (auto tpl: euclidean_search(particles.get_query(),get<position>(i),r)) {
+                    ids.insert(get<id>(std::get<0>(tpl)));
+                }
+            }
+            return neighbours;
+        };
+        const std::map<size_t,std::multiset<size_t>> before = find_neighbours();
+        std::map<size_t,double_d> positions;
+        for (typename particles_type::reference i: particles) {
+            positions[get<id>(i)] = get<position>(i);
+        }
+
+        particles.reorder_morton();
+
+        TS_ASSERT_EQUALS(particles.size(),N);
+        detail::bbox<D> bounds(min,max);
+        for (int i=0; i<particles.size(); ++i) {
+            TS_ASSERT((positions[get<id>(particles)[i]] == get<position>(particles)[i]).all());
+            if (i > 0) {
+                TS_ASSERT_LESS_THAN_EQUALS(
+                    detail::morton_code(double_d(get<position>(particles)[i-1]),bounds),
+                    detail::morton_code(double_d(get<position>(particles)[i]),bounds));
+            }
+        }
+        TS_ASSERT(find_neighbours() == before);
+    }
+
+    template<unsigned int D, 
+             template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_bucket_pairs(const int N, const double r, const int neighbour_n, const bool is_periodic) {
+    	typedef Particles<std::tuple<>,D,VectorType,SearchMethod> particles_type;
+        typedef position_d<D> position;
+        typedef Vector<double,D> double_d;
+        typedef Vector<bool,D> bool_d;
+        typedef Vector<int,D> int_d;
+    	double_d min(-1);
+    	double_d max(1);
+    	bool_d periodic(is_periodic);
+        particles_type particles(N);
+        double r2 = r*r;
+
+        std::cout << "bucket pairs test (D="<<D<<" periodic= "<<is_periodic<<"  N="<<N<<" r="<<r<<"):" << std::endl;
+
+        std::default_random_engine gen; 
+        std::uniform_real_distribution<double> uniform(-1,1);
+        for (int i=0; i<N; ++i) {
+            for (int d = 0; d < D; ++d) {
+                get<position>(particles)[i][d] = uniform(gen);
+            }
+        }
+    	particles.init_neighbour_search(min,max,periodic,neighbour_n);
+
+        // brute force count, excluding each particle itself
+        std::vector<int> brute_count(N,0);
+        for (int i=0; i<N; ++i) {
+            const double_d& pi = get<position>(particles)[i];
+            for (int j=0; j<N; ++j) {
+                const double_d& pj = get<position>(particles)[j];
+                if (is_periodic) {
+                    for (lattice_iterator<D> periodic_it(int_d(-1),int_d(2)); 
+                            periodic_it != false; ++periodic_it) {
+                        const double_d shift = (*periodic_it)*(max-min);
+                        if ((i != j || (shift != 0).any()) 
+                                && (pi+shift-pj).squaredNorm() <= r2) {
+                            brute_count[get<id>(particles)[i]]++;
+                        }
+                    }
+                } else if (i != j && (pi-pj).squaredNorm() <= r2) {
+                    brute_count[get<id>(particles)[i]]++;
+                }
+            }
+        }
+
+        for (bool half: {false,true}) {
+            std::vector<int> count(N,0);
+            auto count_pair = [&](const double_d& dx, const size_t a, const size_t b) {
+                if (dx.squaredNorm() <= r2) {
+                    count[a]++;
+                    if (half) count[b]++;
+                }
+            };
+            for_each_bucket_pair(particles.get_query(),r,
+                [&](const auto& particles_i, const auto& particles_j, 
+                    const double_d& shift, const bool self) {
+                    for (auto a = particles_i.begin(); a != particles_i.end(); ++a) {
+                        auto b = particles_j.begin(); 
+                        if (self && half) {
+                            b = a; 
+                            ++b;
+                        }
+                        for (; b != particles_j.end(); ++b) {
+                            if (self && !half && get<id>(*a) == get<id>(*b)) continue;
+                            count_pair(get<position>(*b)+shift-get<position>(*a),
+                                       get<id>(*a),get<id>(*b));
+                        }
+                    }
+                },half);
+            for (int i=0; i<N; ++i) {
+                TS_ASSERT_EQUALS(count[i],brute_count[i]);
+            }
+        }
+    }
+
+    template<template <typename,typename> class VectorType,
+             template <typename> class SearchMethod>
+    void helper_d_test_list_update_positions() {
+        helper_d_update_positions<1,VectorType,SearchMethod>(1000,0.1,10,true);
+        helper_d_update_positions<2,VectorType,SearchMethod>(1000,0.1,10,true);
+        helper_d_update_positions<2,VectorType,SearchMethod>(1000,0.1,10,false);
+        helper_d_update_positions<3,VectorType,SearchMethod>(1000,0.2,10,true);
+        helper_d_update_positions<3,VectorType,SearchMethod>(1000,0.2,10,false);
+    }
+
     template<template <typename,typename> class VectorType,
              template <typename> class SearchMethod>
     void helper_d_test_list_regular() {
@@ -419,6 +808,12 @@ For example,
        
         helper_d_test_list_regular<std::vector,bucket_search_serial>();
         helper_d_test_list_random<std::vector,bucket_search_serial>();
+        helper_d_test_list_update_positions<std::vector,bucket_search_serial>();
+        helper_d_bucket_pairs<2,std::vector,bucket_search_serial>(1000,0.1,10,true);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_serial>(1000,0.2,10,false);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_serial>(1000,0.7,10,true);
+        helper_d_reorder_morton<2,std::vector,bucket_search_serial>(1000,0.1,10,true);
+        helper_d_reorder_morton<3,std::vector,bucket_search_serial>(1000,0.2,10,false);
     }
 
     void test_std_vector_bucket_search_parallel(void) {
@@ -427,11 +822,32 @@ For example,
 
         helper_d_test_list_regular<std::vector,bucket_search_parallel>();
         helper_d_test_list_random<std::vector,bucket_search_parallel>();
+        helper_d_test_list_update_positions<std::vector,bucket_search_parallel>();
+        helper_d_bucket_pairs<2,std::vector,bucket_search_parallel>(1000,0.1,10,true);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_parallel>(1000,0.2,10,false);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_parallel>(1000,0.7,10,true);
+    }
+
+    void test_std_vector_bucket_search_hash(void) {
+        helper_single_particle<std::vector,bucket_search_hash>();
+        helper_two_particles<std::vector,bucket_search_hash>();
+
+        helper_d_test_list_regular<std::vector,bucket_search_hash>();
+        helper_d_test_list_random<std::vector,bucket_search_hash>();
+        helper_d_test_list_update_positions<std::vector,bucket_search_hash>();
+        helper_d_bucket_pairs<2,std::vector,bucket_search_hash>(1000,0.1,10,true);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_hash>(1000,0.2,10,false);
+        helper_d_bucket_pairs<3,std::vector,bucket_search_hash>(1000,0.7,10,true);
+        helper_d_reorder_morton<2,std::vector,bucket_search_hash>(1000,0.1,10,true);
+        helper_d_reorder_morton<3,std::vector,bucket_search_hash>(1000,0.2,10,false);
+        helper_d_test_list_clustered<std::vector,bucket_search_hash>();
     }
 
     void test_std_vector_nanoflann_adaptor(void) {
         helper_d_test_list_random<std::vector,nanoflann_adaptor>();
         helper_d_test_list_regular<std::vector,nanoflann_adaptor>();
+        helper_d_insert_delete<2,std::vector,nanoflann_adaptor>(1000,0.1,10,true);
+        helper_d_insert_delete<3,std::vector,nanoflann_adaptor>(1000,0.2,10,false);
     }
 
     void test_std_vector_octtree(void) {
@@ -81,6 +81,38 @@ public:
         TS_ASSERT(((double6)get<position>(test[0])==double6(2.0)).all());
     }
 
+    template<template <typename,typename> class V, template <typename> class SearchMethod>
+    void helper_add_particles(void) {
+        ABORIA_VARIABLE(scalar,double,"scalar")
+        typedef std::tuple<scalar> variables_type;
+    	typedef Particles<variables_type,3,V,SearchMethod> Test_type;
+        typedef position_d<3> position;
+    	Test_type test(2);
+        get<position>(test)[0] = double3(0.1);
+        get<position>(test)[1] = double3(0.9);
+        test.init_neighbour_search(double3(0),double3(1),bool3(false));
+
+        // the second new particle is outside the domain and is not added
+    	Test_type new_particles(3);
+        get<position>(new_particles)[0] = double3(0.5);
+        get<position>(new_particles)[1] = double3(2.0);
+        get<position>(new_particles)[2] = double3(0.25);
+        get<scalar>(new_particles)[2] = 1.0;
+    	test.push_back(new_particles);
+    	TS_ASSERT_EQUALS(test.size(),4);
+        TS_ASSERT(((double3)get<position>(test[3])==double3(0.25)).all());
+        TS_ASSERT_EQUALS(get<scalar>(test[3]),1.0);
+        TS_ASSERT_EQUALS(get<id>(test[2]),2);
+        TS_ASSERT_EQUALS(get<id>(test[3]),3);
+
+        int count = 0;
+        for (auto i: euclidean_search(test.get_query(),double3(0.25),0.1)) {
+            TS_ASSERT_EQUALS(get<id>(std::get<0>(i)),3);
+            ++count;
+        }
+        TS_ASSERT_EQUALS(count,1);
+    }
+
     template<template <typename,typename> class V, template <typename> class SearchMethod>
     void helper_add_delete_particle(void) {
         ABORIA_VARIABLE(scalar,double,"scalar")
@@ -378,6 +410,7 @@ public:
         helper_add_particle2<std::vector,bucket_search_serial>();
         helper_add_particle2_dimensions<std::vector,bucket_search_serial>();
         helper_add_delete_particle<std::vector,bucket_search_serial>();
+        helper_add_particles<std::vector,bucket_search_serial>();
     }
 
     void test_std_vector_bucket_search_parallel(void) {
@@ -385,6 +418,23 @@ public:
         helper_add_particle2<std::vector,bucket_search_parallel>();
         helper_add_particle2_dimensions<std::vector,bucket_search_parallel>();
         helper_add_delete_particle<std::vector,bucket_search_parallel>();
+        helper_add_particles<std::vector,bucket_search_parallel>();
+    }
+
+    void test_std_vector_bucket_search_hash(void) {
+        helper_add_particle1<std::vector,bucket_search_hash>();
+        helper_add_particle2<std::vector,bucket_search_hash>();
+        helper_add_particle2_dimensions<std::vector,bucket_search_hash>();
+        helper_add_delete_particle<std::vector,bucket_search_hash>();
+        helper_add_particles<std::vector,bucket_search_hash>();
+    }
+
+    void test_std_vector_nanoflann_adaptor(void) {
+        helper_add_particle1<std::vector,nanoflann_adaptor>();
+        helper_add_particle2<std::vector,nanoflann_adaptor>();
+        helper_add_particle2_dimensions<std::vector,nanoflann_adaptor>();
+        helper_add_delete_particle<std::vector,nanoflann_adaptor>();
+        helper_add_particles<std::vector,nanoflann_adaptor>();
     }
 
     void test_thrust_vector(void) {
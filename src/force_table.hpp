@@ -0,0 +1,108 @@
+#ifndef FORCE_TABLE_H_
+#define FORCE_TABLE_H_
+
+#include "sparpy.h"
+
+namespace sparpy {
+
+/// Tabulated radial force, replacing `force_over_r(r2)` of a pair force by
+/// a cubic interpolation.
+///
+/// The function is sampled at `n+1` equally spaced points in r2 between 0 and
+/// `cutoff^2` and interpolated on each interval with a Catmull-Rom spline, so
+/// evaluating the table only costs a lookup of four coefficients and no
+/// transcendental functions. Close to r=0, where most forces diverge, the
+/// spline is not accurate, so the table starts above the last interval whose
+/// relative error exceeds \p tolerance. `contains(r2)` is false below this
+/// and past the cutoff. `get_max_error()` gives the largest error of the
+/// force magnitude `r*force_over_r(r2)` found in the tabulated intervals.
+/// The error is sampled at a quarter, half and three quarters of each
+/// interval: the errors due to the slopes cancel at the midpoint, so it
+/// alone underestimates the error several times.
+class force_table {
+    double m_h;
+    double m_inv_h;
+    double m_r2_min;
+    double m_r2_max;
+    double m_max_error;
+    size_t m_n;
+    std::vector<double> m_coefficients;
+
+public:
+    force_table():
+        m_h(0),m_inv_h(0),m_r2_min(0),m_r2_max(0),m_max_error(0),m_n(0)
+    {}
+
+    template <typename F>
+    void build(const F& force_over_r, const double cutoff, const size_t n,
+               const double tolerance=1e-6) {
+        if (n < 3) {
+            throw std::invalid_argument("force_table: need at least 3 intervals");
+        }
+        m_n = n;
+        m_r2_max = cutoff*cutoff;
+        m_h = m_r2_max/n;
+        m_inv_h = 1.0/m_h;
+
+        std::vector<double> f(n+2);
+        for (size_t k=1; k<n+2; ++k) {
+            f[k] = force_over_r(k*m_h);
+        }
+
+        // slopes in units of the interval width
+        std::vector<double> m(n+1);
+        m[1] = 0.5*(-3*f[1] + 4*f[2] - f[3]);
+        for (size_t k=2; k<n+1; ++k) {
+            m[k] = 0.5*(f[k+1] - f[k-1]);
+        }
+
+        m_coefficients.assign(4*n,0);
+        for (size_t k=1; k<n; ++k) {
+            double* c = &m_coefficients[4*k];
+            c[0] = f[k];
+            c[1] = m[k];
+            c[2] = 3*(f[k+1] - f[k]) - 2*m[k] - m[k+1];
+            c[3] = 2*(f[k] - f[k+1]) + m[k] + m[k+1];
+        }
+
+        std::vector<double> error(n,0);
+        size_t first = 1;
+        for (size_t k=1; k<n; ++k) {
+            for (const double t: {0.25,0.5,0.75}) {
+                const double r2 = (k+t)*m_h;
+                const double exact = force_over_r(r2);
+                const double e = std::abs((*this)(r2) - exact);
+                const double scale = std::max(std::abs(exact),
+                                              std::max(std::abs(f[k]),std::abs(f[k+1])));
+                if (e > tolerance*scale) first = k+1;
+                error[k] = std::max(error[k],e*std::sqrt(r2));
+            }
+        }
+        m_r2_min = first*m_h;
+        m_max_error = 0;
+        for (size_t k=first; k<n; ++k) {
+            if (error[k] > m_max_error) m_max_error = error[k];
+        }
+    }
+
+    bool empty() const { return m_n == 0; }
+    size_t size() const { return m_n; }
+    double get_min_radius() const { return std::sqrt(m_r2_min); }
+    double get_max_error() const { return m_max_error; }
+
+    bool contains(const double r2) const {
+        return r2 >= m_r2_min && r2 <= m_r2_max;
+    }
+
+    double operator()(const double r2) const {
+        const double x = r2*m_inv_h;
+        const size_t k = std::min(static_cast<size_t>(x),m_n-1);
+        const double t = x - k;
+        const double* c = &m_coefficients[4*k];
+        return c[0] + t*(c[1] + t*(c[2] + t*c[3]));
+    }
+};
+
+}
+
+#endif
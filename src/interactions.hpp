@@ -2,163 +2,883 @@
 #define INTERACTIONS_H_
 
 #include "sparpy.h"
+#include "verlet_list.hpp"
+#include "force_table.hpp"
+#include "simd.hpp"
 
 namespace sparpy {
 
+/// Neighbours of a particle i, gathered into contiguous arrays so that
+/// the force of `simd_block_size` pairs can be evaluated at once.
+template <unsigned int D>
+struct pair_block {
+    typedef Vector<double,D> double_d;
+
+    int n;
+    size_t j[simd_block_size];
+    double r2[simd_block_size];
+    double species[simd_block_size];
+    double dx[D][simd_block_size];
+    double c_i[simd_block_size];
+    double c_j[simd_block_size];
+
+    template <typename Flush>
+    void push_back(const size_t index, const double_d& dxj, const double r2j,
+                   const double species_j, Flush flush) {
+        j[n] = index;
+        r2[n] = r2j;
+        species[n] = species_j;
+        for (int d=0; d<D; ++d) {
+            dx[d][n] = dxj[d];
+        }
+        if (++n == simd_block_size) {
+            flush(*this);
+            n = 0;
+        }
+    }
+};
 
+/// Forces scattered by the threads of a self-interaction onto particles
+/// they do not own, for every thread but the first (which writes the forces
+/// directly). The particles are split into blocks of `block_size`, and each
+/// thread only stores the blocks it writes, so the buffers are small when
+/// the particles are spatially sorted (see `reorder_particles`). They are 
+/// allocated for a single evaluation.
 template <unsigned int D>
-struct exponential_force {
-    typedef ParticlesType<D> particles_type;
+class scatter_buffers {
     typedef Vector<double,D> double_d;
-    typedef typename particles_type::position position;
+    static const size_t block_size = 256;
+
+    /// the blocks written by a thread, stored in the order they were first
+    /// written. `m_slot` holds the position of each block in `m_forces`, or
+    /// -1 if the thread has not written it
+    struct thread_buffer {
+        std::vector<int> m_slot;
+        std::vector<double_d> m_forces;
+    };
+    std::vector<thread_buffer> m_threads;
+
+public:
+    /// Makes room for \p n particles for each of \p n_threads threads
+    void resize(const int n_threads, const size_t n) {
+        const size_t n_blocks = (n+block_size-1)/block_size;
+        m_threads.resize(n_threads-1);
+        for (thread_buffer& buffer: m_threads) {
+            buffer.m_slot.assign(n_blocks,-1);
+            buffer.m_forces.clear();
+        }
+    }
+
+    /// The force scattered by \p thread, which must not be the first, onto
+    /// particle \p j. The reference is valid until the thread writes a 
+    /// block it has not written before.
+    double_d& force(const int thread, const size_t j) {
+        thread_buffer& buffer = m_threads[thread-1];
+        int& slot = buffer.m_slot[j/block_size];
+        if (slot < 0) {
+            slot = buffer.m_forces.size()/block_size;
+            buffer.m_forces.resize(buffer.m_forces.size()+block_size,double_d(0));
+        }
+        return buffer.m_forces[slot*block_size + j%block_size];
+    }
+
+    /// Adds the written blocks of all the threads to the forces \p f of
+    /// the \p n particles. Must be called by all the threads of the 
+    /// parallel region.
+    void reduce(double_d* f, const size_t n) {
+        const size_t n_blocks = (n+block_size-1)/block_size;
+        #pragma omp for
+        for (size_t b=0; b<n_blocks; ++b) {
+            const size_t end = std::min(n,(b+1)*block_size);
+            for (const thread_buffer& buffer: m_threads) {
+                const int slot = buffer.m_slot[b];
+                if (slot < 0) continue;
+                const double_d* ft = &buffer.m_forces[slot*block_size];
+                for (size_t i=b*block_size; i<end; ++i) {
+                    f[i] += ft[i-b*block_size];
+                }
+            }
+        }
+    }
+};
+
+/// True for the neighbour searches whose buckets form a regular grid, so
+/// that pairs of buckets can be visited with `for_each_bucket_pair`.
+template <typename Query>
+struct has_bucket_grid: std::false_type {};
+
+template <typename Traits>
+struct has_bucket_grid<bucket_search_serial_query<Traits>>: std::true_type {};
+
+template <typename Traits>
+struct has_bucket_grid<bucket_search_parallel_query<Traits>>: std::true_type {};
+
+template <typename Traits>
+struct has_bucket_grid<bucket_search_hash_query<Traits>>: std::true_type {};
+
+/// Base class for the radial pair forces between two particle sets.
+///
+/// Derived classes provide a cutoff `m_cutoff`, a species filter
+/// `interacts_with(species_j)` and the magnitude of the pair force divided
+/// by the separation, `force_over_r(r2)`, so that the force on particle i due
+/// to particle j is `force_over_r(r2)*dx` with `dx = r_j - r_i`.
+///
+/// By default only pairs within the cutoff are visited, using the neighbour
+/// search of the second particle set. Setting \p all_pairs evaluates every
+/// pair instead (ignoring the cutoff and periodicity), which is useful for
+/// validation. Alternatively, the pairs can be taken from a cached
+/// `verlet_list` built with at least the same cutoff.
+///
+/// For a self-interaction (both particle sets are the same) each unordered
+/// pair is only visited once, adding the force to i and its opposite to j.
+/// This halves the number of `force_over_r` evaluations.
+///
+/// The neighbour search radius of particle i is `search_radius(species_i)`,
+/// which defaults to the cutoff but can be overridden by forces whose cutoff
+/// depends on the species.
+///
+/// Calling `tabulate(n)` replaces `force_over_r` within the cutoff by a
+/// `force_table` with \p n intervals, returning the table's maximum error.
+///
+/// When built with OpenMP the loop over the particles in the first set is
+/// split between threads, each thread only writing the force of its own
+/// particles.
+///
+/// The particle sets can use any of the neighbour searches, see
+/// `ParticlesType`.
+///
+/// The neighbours of each particle are gathered into blocks of
+/// `simd_block_size` pairs, and `force_over_r` is evaluated over a block in
+/// a vectorised loop (see `evaluate_pairs`), so it should be branch-free and
+/// use `simd_exp` rather than `std::exp`.
+template <typename Derived, unsigned int D>
+struct pair_force {
+    typedef Vector<double,D> double_d;
+    typedef position_d<D> position;
     typedef force_d<D> force;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
 
+    bool m_all_pairs;
+    force_table m_table;
+    pair_force(const bool all_pairs):
+        m_all_pairs(all_pairs)
+    {}
+
+    const Derived& cast() const { return static_cast<const Derived&>(*this); }
+
+    double tabulate(const size_t n) {
+        m_table.build([this](const double r2) { return cast().force_over_r(r2); },
+                      cast().m_cutoff,n);
+        return m_table.get_max_error();
+    }
+
+    double evaluate(const double r2) const {
+        return m_table.contains(r2) ? m_table(r2) : cast().force_over_r(r2);
+    }
+
+    double search_radius(const double /*species_i*/) const {
+        return cast().m_cutoff;
+    }
+
+    template <typename Particles>
+    void operator()(std::shared_ptr<Particles> particles1, std::shared_ptr<Particles> particles2) {
+        if (m_all_pairs) {
+            cast().all_pairs(*particles1,*particles2);
+        } else if (particles1 == particles2) {
+            symmetric_neighbour_search(*particles1);
+        } else {
+            neighbour_search(*particles1,*particles2);
+        }
+    }
+
+    template <typename Particles>
+    void operator()(std::shared_ptr<Particles> particles1, std::shared_ptr<Particles> particles2,
+                    verlet_list<D>& list) {
+        if (m_all_pairs) {
+            cast().all_pairs(*particles1,*particles2);
+        } else {
+            list.update(*particles1,*particles2);
+            if (list.m_half) {
+                symmetric_verlet_search(*particles1,list);
+            } else {
+                verlet_search(*particles1,*particles2,list);
+            }
+        }
+    }
+
+    template <typename Particles>
+    void neighbour_search(Particles& particles1, const Particles& particles2) const {
+        const double* s1 = get<species>(particles1).data();
+        owner_sum(particles1,particles2,[&](const size_t i, auto visit) {
+            const double radius = cast().search_radius(s1[i]);
+            for_each_neighbour(particles2.get_query(),get<position>(particles1)[i],radius,
+                [&](const size_t j, const double_d& dx, const double r2) {
+                    if (r2 != 0) {
+                        visit(j,dx,r2);
+                    }
+                });
+        });
+    }
+
+    template <typename Particles>
+    void verlet_search(Particles& particles1, const Particles& particles2,
+                       const verlet_list<D>& list) const {
+        const double cutoff2 = cast().m_cutoff*cast().m_cutoff;
+        const double_d* x2 = get<position>(particles2).data();
+        owner_sum(particles1,particles2,[&](const size_t i, auto visit) {
+            const double_d& xi = get<position>(particles1)[i];
+            for (size_t k=list.m_offsets[i]; k<list.m_offsets[i+1]; ++k) {
+                const size_t j = list.m_neighbours[k];
+                const double_d dx = x2[j] - xi + list.m_shifts[k];
+                const double r2 = dx.squaredNorm();
+                if (r2 != 0 && r2 <= cutoff2) {
+                    visit(j,dx,r2);
+                }
+            }
+        });
+    }
+
+    template <typename Particles>
+    void symmetric_neighbour_search(Particles& particles) const {
+        symmetric_neighbour_search(particles,
+                has_bucket_grid<typename Particles::query_type>());
+    }
+
+    /// Visits the pairs of a self-interaction by searching around each
+    /// particle, for searches without a bucket grid (the trees).
+    template <typename Particles>
+    void symmetric_neighbour_search(Particles& particles, std::false_type) const {
+        const double_d* x = get<position>(particles).data();
+        const double* s = get<species>(particles).data();
+        const auto& query = particles.get_query();
+        symmetric_sum(particles,particles.size(),[&](const size_t i, auto sum) {
+            sum(i,[&](auto visit) {
+                const double radius = cast().search_radius(s[i]);
+                for_each_neighbour(query,x[i],radius,
+                    [&](const size_t j, const double_d& dx, const double r2) {
+                        if (j > i && r2 != 0) {
+                            visit(j,dx,r2);
+                        }
+                    });
+            });
+        });
+    }
+
+    /// Visits the pairs of a self-interaction bucket by bucket, using the
+    /// half stencil of neighbouring buckets of `for_each_bucket_pair`
+    /// rather than a search around every particle. The stencil uses the
+    /// largest search radius of all the particles, and `evaluate_pairs`
+    /// applies the actual cutoffs. Grids with many more buckets than
+    /// particles (e.g. a hashed grid) are searched around each particle
+    /// instead.
+    template <typename Particles>
+    void symmetric_neighbour_search(Particles& particles, std::true_type) const {
+        const double_d* x = get<position>(particles).data();
+        const auto& query = particles.get_query();
+        if (query.number_of_buckets() > 4*particles.size()) {
+            symmetric_neighbour_search(particles,std::false_type());
+            return;
+        }
+
+        const double* s = get<species>(particles).data();
+        double radius = 0;
+        for (size_t i=0; i<particles.size(); ++i) {
+            radius = std::max(radius,cast().search_radius(s[i]));
+        }
+        const double radius2 = radius*radius;
+        typedef typename Particles::query_type::particle_iterator particle_iterator;
+        typedef std::tuple<iterator_range<particle_iterator>,double_d,bool> bucket_pair;
+        int n_threads = 1;
+#ifdef HAVE_OPENMP
+        n_threads = omp_get_max_threads();
+#endif
+        // the neighbouring buckets of the current bucket, for each thread
+        std::vector<std::vector<bucket_pair>> thread_pairs(n_threads);
+        const auto buckets = query.get_subtree().begin();
+        symmetric_sum(particles,query.number_of_buckets(),[&](const size_t k, auto sum) {
+            auto bucket = buckets;
+            bucket += k;
+            int thread = 0;
+#ifdef HAVE_OPENMP
+            thread = omp_get_thread_num();
+#endif
+            std::vector<bucket_pair>& pairs = thread_pairs[thread];
+            pairs.clear();
+            for_each_bucket_pair(query,*bucket,radius,
+                [&](const iterator_range<particle_iterator>& /*particles_i*/,
+                    const iterator_range<particle_iterator>& particles_j,
+                    const double_d& shift, const bool self) {
+                    pairs.emplace_back(particles_j,shift,self);
+                },true);
+            if (pairs.empty()) return;
+
+            const auto particles_i = query.get_bucket_particles(*bucket);
+            for (auto a = particles_i.begin(); a != particles_i.end(); ++a) {
+                const size_t i = &get<position>(*a) - x;
+                sum(i,[&](auto visit) {
+                    for (const bucket_pair& pair: pairs) {
+                        const double_d& shift = std::get<1>(pair);
+                        auto b = std::get<0>(pair).begin();
+                        if (std::get<2>(pair)) {
+                            b = a;
+                            ++b;
+                        }
+                        for (; b != std::get<0>(pair).end(); ++b) {
+                            const size_t j = &get<position>(*b) - x;
+                            const double_d dx = x[j] + shift - x[i];
+                            const double r2 = dx.squaredNorm();
+                            if (r2 != 0 && r2 <= radius2) {
+                                visit(j,dx,r2);
+                            }
+                        }
+                    }
+                });
+            }
+        });
+    }
+
+    template <typename Particles>
+    void symmetric_verlet_search(Particles& particles, const verlet_list<D>& list) const {
+        const double cutoff2 = cast().m_cutoff*cast().m_cutoff;
+        const double_d* x = get<position>(particles).data();
+        symmetric_sum(particles,particles.size(),[&](const size_t i, auto sum) {
+            sum(i,[&](auto visit) {
+                for (size_t k=list.m_offsets[i]; k<list.m_offsets[i+1]; ++k) {
+                    const size_t j = list.m_neighbours[k];
+                    const double_d dx = x[j] - x[i] + list.m_shifts[k];
+                    const double r2 = dx.squaredNorm();
+                    if (r2 != 0 && r2 <= cutoff2) {
+                        visit(j,dx,r2);
+                    }
+                }
+            });
+        });
+    }
+
+    /// Evaluates the first `b.n` pairs of a block, setting `b.c_i` to the
+    /// force on i divided by the separation and `b.c_j` to the (opposite)
+    /// force on j, or to zero where the species do not interact or the pair
+    /// is beyond the cutoff (the block may come from a search with a larger
+    /// cutoff, see `composite_force`).
+    void evaluate_pairs(pair_block<D>& b, const double species_i) const {
+        const Derived& pair = cast();
+        const double cutoff2 = pair.m_cutoff*pair.m_cutoff;
+        if (!m_table.empty()) {
+            const bool i_interacts = pair.interacts_with(species_i);
+            for (int k=0; k<b.n; ++k) {
+                const double c = b.r2[k] <= cutoff2 ? evaluate(b.r2[k]) : 0;
+                b.c_i[k] = pair.interacts_with(b.species[k]) ? c : 0;
+                b.c_j[k] = i_interacts ? c : 0;
+            }
+        } else {
+            // masks for the species and cutoff, unused lanes are evaluated
+            // at the cutoff and masked out
+            const double i_interacts = pair.interacts_with(species_i);
+            for (int k=0; k<b.n; ++k) {
+                const double within = b.r2[k] <= cutoff2;
+                b.c_i[k] = within*pair.interacts_with(b.species[k]);
+                b.c_j[k] = within*i_interacts;
+            }
+            for (int k=b.n; k<simd_block_size; ++k) {
+                b.r2[k] = cutoff2;
+                b.c_i[k] = 0;
+                b.c_j[k] = 0;
+            }
+            evaluate_block(b);
+        }
+    }
+
+    /// Multiplies the masks in `b.c_i` and `b.c_j` by `force_over_r` of all
+    /// `simd_block_size` pairs in the block.
+    SPARPY_SIMD_TARGET
+    void evaluate_block(pair_block<D>& b) const {
+        const Derived& pair = cast();
+        #pragma omp simd
+        for (int k=0; k<simd_block_size; ++k) {
+            const double c = pair.force_over_r(b.r2[k]);
+            b.c_i[k] *= c;
+            b.c_j[k] *= c;
+        }
+    }
+
+    /// Sums the forces on the particles in the first set, where
+    /// `for_each_neighbour(i,visit)` calls `visit(j,dx,r2)` for every
+    /// neighbour j in the second set. Each thread only writes the forces of
+    /// its own particles.
+    template <typename Particles, typename ForEachNeighbour>
+    void owner_sum(Particles& particles1, const Particles& particles2,
+                   ForEachNeighbour for_each_neighbour) const {
+        const double* s1 = get<species>(particles1).data();
+        const double* s2 = get<species>(particles2).data();
+        double_d* f = get<force>(particles1).data();
+        #pragma omp parallel
+        {
+            pair_block<D> b = pair_block<D>();
+            #pragma omp for schedule(dynamic,64)
+            for (size_t i=0; i<particles1.size(); ++i) {
+                double_d fi(0);
+                auto flush = [&](pair_block<D>& block) {
+                    cast().evaluate_pairs(block,s1[i]);
+                    for (int k=0; k<block.n; ++k) {
+                        for (int d=0; d<D; ++d) {
+                            fi[d] += block.c_i[k]*block.dx[d][k];
+                        }
+                    }
+                };
+                b.n = 0;
+                for_each_neighbour(i,[&](const size_t j, const double_d& dx, const double r2) {
+                    b.push_back(j,dx,r2,s2[j],flush);
+                });
+                flush(b);
+                f[i] += fi;
+            }
+        }
+    }
+
+    /// Sums the forces of a self-interaction, split into \p n_items work
+    /// items that are shared between the threads. `for_each_particle(k,sum)`
+    /// calls `sum(i,for_each_neighbour)` for the particles i of item k, where
+    /// `for_each_neighbour(visit)` calls `visit(j,dx,r2)` for the neighbours
+    /// j of i, so that every unordered pair is visited once. The force on j
+    /// is scattered by the thread that owns i, so every thread but the first
+    /// accumulates it in a `scatter_buffers`, which is summed at the end.
+    template <typename Particles, typename ForEachParticle>
+    void symmetric_sum(Particles& particles, const size_t n_items,
+                       ForEachParticle for_each_particle) const {
+        const size_t n = particles.size();
+        const double* s = get<species>(particles).data();
+        double_d* f = get<force>(particles).data();
+        scatter_buffers<D> scatter;
+        #pragma omp parallel
+        {
+            int thread = 0;
+#ifdef HAVE_OPENMP
+            thread = omp_get_thread_num();
+            #pragma omp single
+            scatter.resize(omp_get_num_threads(),n);
+#endif
+
+            pair_block<D> b = pair_block<D>();
+            auto sum = [&](const size_t i, auto for_each_neighbour) {
+                double_d fi(0);
+                auto flush = [&](pair_block<D>& block) {
+                    cast().evaluate_pairs(block,s[i]);
+                    for (int k=0; k<block.n; ++k) {
+                        double_d& fj = thread == 0 ? f[block.j[k]] 
+                                                   : scatter.force(thread,block.j[k]);
+                        for (int d=0; d<D; ++d) {
+                            fi[d] += block.c_i[k]*block.dx[d][k];
+                            fj[d] -= block.c_j[k]*block.dx[d][k];
+                        }
+                    }
+                };
+                b.n = 0;
+                for_each_neighbour([&](const size_t j, const double_d& dx, const double r2) {
+                    b.push_back(j,dx,r2,s[j],flush);
+                });
+                flush(b);
+                if (thread == 0) {
+                    f[i] += fi;
+                } else {
+                    scatter.force(thread,i) += fi;
+                }
+            };
+            #pragma omp for schedule(dynamic,64)
+            for (size_t k=0; k<n_items; ++k) {
+                for_each_particle(k,sum);
+            }
+
+            scatter.reduce(f,n);
+        }
+    }
+
+    template <typename Particles>
+    void all_pairs(Particles& particles1, const Particles& particles2) const {
+        const Derived& pair = cast();
+        #pragma omp parallel for
+        for (size_t i=0; i<particles1.size(); ++i) {
+            for (size_t j=0; j<particles2.size(); ++j) {
+                if (!pair.interacts_with(get<species>(particles2)[j])) continue;
+                const double_d dx = get<position>(particles2)[j]-get<position>(particles1)[i];
+                const double r2 = dx.squaredNorm();
+                if (r2 != 0) {
+                    get<force>(particles1)[i] += evaluate(r2)*dx;
+                }
+            }
+        }
+    }
+};
+
+template <unsigned int D>
+struct exponential_force: public pair_force<exponential_force<D>,D> {
     double m_cutoff;
     double m_epsilon;
-    exponential_force(const double cutoff, const double epsilon):
+    exponential_force(const double cutoff, const double epsilon, const bool all_pairs=false):
+        pair_force<exponential_force<D>,D>(all_pairs),
         m_cutoff(cutoff),m_epsilon(epsilon)
     {}
 
-    void operator()(particles_pointer particles1, particles_pointer particles2) {
-        Symbol<position> p;
-        Symbol<force> f;
-        Symbol<species> w;
-        Symbol<id> id_;
-        Label<0,particles_type> a(*particles1);
-        Label<1,particles_type> b(*particles2);
-        auto dx = create_dx(a,b);
-        AccumulateWithinDistance<std::plus<double_d> > sum(m_cutoff);
-        //std::cout << "calc force" << m_epsilon << m_cutoff<< std::endl;
-        //f[a] += sum(b,if_else(norm(dx)!=0 && w[b]==0,(1.0/m_epsilon)*exp(-norm(dx)/m_epsilon)/norm(dx),0)*dx);
-        //f[a] += sum(b,if_else(norm(dx)!=0,(1.0/m_epsilon)*exp(-norm(dx)/m_epsilon)/norm(dx),0)*dx);
-	for (int i=0; i<particles1->size(); ++i) {
-		for (int j=0; j<particles2->size(); ++j) {
-			if (get<species>(*particles2)[j] != 0) continue;
-			const double_d dx = get<position>(*particles2)[j]-get<position>(*particles1)[i];
-			const double r2 = dx.squaredNorm();
-			if (r2 != 0) {
-				const double r = std::sqrt(r2);
-				get<force>(*particles1)[i] += (1.0/m_epsilon)*std::exp(-r/m_epsilon)*dx/r; 
-			}
-		}
-	}
+    bool interacts_with(const double species_j) const {
+        return species_j == 0;
     }
-};
-
 
+    double force_over_r(const double r2) const {
+        const double r = std::sqrt(r2);
+        return (1.0/m_epsilon)*simd_exp(-r/m_epsilon)/r;
+    }
+};
 
 template <unsigned int D>
-struct morse_force {
-    typedef ParticlesType<D> particles_type;
-    typedef Vector<double,D> double_d;
-    typedef typename particles_type::position position;
-    typedef force_d<D> force;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
-  
+struct morse_force: public pair_force<morse_force<D>,D> {
     double m_cutoff;
     double m_Ca;
     double m_la;
     double m_Cr;
     double m_lr;
     double m_type;
-    morse_force(const double cutoff, const double Ca, const double la, const double Cr, const double lr, const double type):
+    morse_force(const double cutoff, const double Ca, const double la, const double Cr, const double lr, const double type, const bool all_pairs=false):
+        pair_force<morse_force<D>,D>(all_pairs),
         m_cutoff(cutoff),m_Ca(Ca),m_la(la),m_Cr(Cr),m_lr(lr),m_type(type)
     {}
-  
-    void operator()(particles_pointer particles1, particles_pointer particles2) {
-        Symbol<position> p;
-        Symbol<force> f;
-        Symbol<id> id_;
-        Label<0,particles_type> a(*particles1);
-        Label<1,particles_type> b(*particles2);
-        auto dx = create_dx(a,b);
-        AccumulateWithinDistance<std::plus<double_d> > sum(m_cutoff);
-        //f[a] += sum(b, if_else(norm(dx)!=0, (m_Ca/m_la*exp(-norm(dx)/m_la) - m_Cr/m_lr*exp(-norm(dx)/m_lr))/norm(dx),0)*dx);
-  for (int i=0; i<particles1->size(); ++i) {
-    for (int j=0; j<particles2->size(); ++j) {
-      if (get<species>(*particles2)[j] != m_type) continue;
-      const double_d dx = get<position>(*particles2)[j]-get<position>(*particles1)[i];
-      const double r2 = dx.squaredNorm();
-      if (r2 != 0) {
+
+    bool interacts_with(const double species_j) const {
+        return species_j == m_type;
+    }
+
+    double force_over_r(const double r2) const {
         const double r = std::sqrt(r2);
-        get<force>(*particles1)[i] += (m_Ca/m_la*std::exp(-r/m_la) - m_Cr/m_lr*std::exp(-r/m_lr))*dx/r;
-      }                               
+        return (m_Ca/m_la*simd_exp(-r/m_la) - m_Cr/m_lr*simd_exp(-r/m_lr))/r;
     }
-  }
-}
 };
-  
-  
-  
-  
-  
 
 template <unsigned int D>
-struct yukawa_force {
-    typedef ParticlesType<D> particles_type;
-    typedef Vector<double,D> double_d;
-    typedef typename particles_type::position position;
-    typedef force_d<D> force;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
+struct yukawa_force: public pair_force<yukawa_force<D>,D> {
+    double m_cutoff;
+    double m_epsilon;
+    yukawa_force(const double cutoff, const double epsilon, const bool all_pairs=false):
+        pair_force<yukawa_force<D>,D>(all_pairs),
+        m_cutoff(cutoff),m_epsilon(epsilon)
+    {}
+
+    bool interacts_with(const double /*species_j*/) const {
+        return true;
+    }
+
+    double force_over_r(const double r2) const {
+        const double r = std::sqrt(r2);
+        return simd_exp(-r/m_epsilon)*(m_epsilon+r)/(r2*r);
+    }
+};
 
+template <unsigned int D>
+struct lennard_jones_force: public pair_force<lennard_jones_force<D>,D> {
     double m_cutoff;
     double m_epsilon;
-    yukawa_force(const double cutoff, const double epsilon):
+    lennard_jones_force(const double cutoff, const double epsilon, const bool all_pairs=false):
+        pair_force<lennard_jones_force<D>,D>(all_pairs),
         m_cutoff(cutoff),m_epsilon(epsilon)
     {}
- 
-    void operator()(particles_pointer particles1, particles_pointer particles2) {
-        Symbol<position> p;
-        Symbol<force> f;
-        Symbol<id> id_;
-        Label<0,particles_type> a(*particles1);
-        Label<1,particles_type> b(*particles2);
-        auto dx = create_dx(a,b);
-        AccumulateWithinDistance<std::plus<double_d> > sum(m_cutoff);
 
-        f[a] += sum(b, if_else(norm(dx)!=0, (exp(-norm(dx)/m_epsilon)*(m_epsilon+norm(dx))/pow(norm(dx),2)) /norm(dx),0)* dx);
+    bool interacts_with(const double /*species_j*/) const {
+        return true;
+    }
+
+    /// Repulsive below a separation of `2^(1/6)*epsilon` and attractive
+    /// above it (a positive value pulls i towards j).
+    double force_over_r(const double r2) const {
+        const double s2 = m_epsilon*m_epsilon/r2;
+        const double s6 = s2*s2*s2;
+        return (6*s6 - 12*s6*s6)/r2;
     }
 };
 
+/// Morse force with its own parameters and cutoff for each pair of species.
+///
+/// The force on a particle of species `si` due to one of species `sj` uses
+/// the parameters given by `set(si,sj,...)`, and pairs of species that have
+/// not been set do not interact. This replaces one `morse_force` per species
+/// with a single force that evaluates each pair once, gathering the
+/// parameters of the pair's species into the block before the vectorised
+/// evaluation. The search radius of each particle is the largest cutoff of
+/// the pairs its species is part of. Species outside [0,n_species) do not
+/// interact.
+template <unsigned int D>
+struct morse_matrix_force: public pair_force<morse_matrix_force<D>,D> {
+    typedef pair_force<morse_matrix_force<D>,D> base;
+    typedef typename base::double_d double_d;
+    typedef typename base::position position;
+    typedef typename base::force force;
+
+    /// Parameters of the pairs in a block.
+    struct lanes {
+        double Ca_la[simd_block_size];
+        double inv_la[simd_block_size];
+        double Cr_lr[simd_block_size];
+        double inv_lr[simd_block_size];
+    };
+
+    int m_n;
+    double m_cutoff;
+    bool m_symmetric;
+    // (m_n+1)^2 parameters, the last row and column are for species that
+    // do not interact
+    std::vector<double> m_cutoff2;
+    std::vector<double> m_Ca_la;
+    std::vector<double> m_inv_la;
+    std::vector<double> m_Cr_lr;
+    std::vector<double> m_inv_lr;
+    std::vector<double> m_radius;
+
+    morse_matrix_force(const int n_species, const bool all_pairs=false):
+        base(all_pairs),
+        m_n(n_species),m_cutoff(0),m_symmetric(true),
+        m_cutoff2((n_species+1)*(n_species+1),-1),
+        m_Ca_la((n_species+1)*(n_species+1),0),
+        m_inv_la((n_species+1)*(n_species+1),0),
+        m_Cr_lr((n_species+1)*(n_species+1),0),
+        m_inv_lr((n_species+1)*(n_species+1),0),
+        m_radius(n_species+1,0)
+    {}
+
+    void set(const int species_i, const int species_j, const double cutoff,
+             const double Ca, const double la, const double Cr, const double lr) {
+        if (species_i < 0 || species_i >= m_n || species_j < 0 || species_j >= m_n) {
+            throw std::invalid_argument("morse_matrix_force: species out of range");
+        }
+        const int k = pair_index(species_i,species_j);
+        m_cutoff2[k] = cutoff*cutoff;
+        m_Ca_la[k] = Ca/la;
+        m_inv_la[k] = 1.0/la;
+        m_Cr_lr[k] = Cr/lr;
+        m_inv_lr[k] = 1.0/lr;
+        m_cutoff = std::max(m_cutoff,cutoff);
+        m_radius[species_i] = std::max(m_radius[species_i],cutoff);
+        m_radius[species_j] = std::max(m_radius[species_j],cutoff);
+
+        m_symmetric = true;
+        for (int si=0; si<m_n; ++si) {
+            for (int sj=0; sj<si; ++sj) {
+                const int ij = pair_index(si,sj);
+                const int ji = pair_index(sj,si);
+                m_symmetric = m_symmetric
+                    && m_cutoff2[ij] == m_cutoff2[ji]
+                    && m_Ca_la[ij] == m_Ca_la[ji] && m_inv_la[ij] == m_inv_la[ji]
+                    && m_Cr_lr[ij] == m_Cr_lr[ji] && m_inv_lr[ij] == m_inv_lr[ji];
+            }
+        }
+    }
+
+    int species_index(const double s) const {
+        return s >= 0 && s < m_n ? static_cast<int>(s) : m_n;
+    }
+
+    int pair_index(const int si, const int sj) const {
+        return si*(m_n+1) + sj;
+    }
+
+    double search_radius(const double species_i) const {
+        return m_radius[species_index(species_i)];
+    }
+
+    double force_over_r(const double r2, const int k) const {
+        const double r = std::sqrt(r2);
+        return (m_Ca_la[k]*simd_exp(-r*m_inv_la[k]) - m_Cr_lr[k]*simd_exp(-r*m_inv_lr[k]))/r;
+    }
+
+    /// Sets `b.c_i` from the parameters of (species_i,species_j) and `b.c_j`
+    /// from those of (species_j,species_i), which are only evaluated
+    /// separately if the matrix is not symmetric.
+    void evaluate_pairs(pair_block<D>& b, const double species_i) const {
+        // unused lanes are evaluated at r=1 with the parameters of a
+        // species that does not interact
+        const int si = species_index(species_i);
+        int sj[simd_block_size];
+        for (int k=0; k<b.n; ++k) {
+            sj[k] = species_index(b.species[k]);
+        }
+        for (int k=b.n; k<simd_block_size; ++k) {
+            b.r2[k] = 1;
+            sj[k] = m_n;
+        }
+
+        int ij[simd_block_size];
+        lanes p;
+        for (int k=0; k<simd_block_size; ++k) {
+            ij[k] = pair_index(si,sj[k]);
+        }
+        gather(b,ij,p,b.c_i);
+        evaluate_lanes(b.r2,p,b.c_i);
+        if (m_symmetric) {
+            for (int k=0; k<b.n; ++k) {
+                b.c_j[k] = b.c_i[k];
+            }
+        } else {
+            for (int k=0; k<simd_block_size; ++k) {
+                ij[k] = pair_index(sj[k],si);
+            }
+            gather(b,ij,p,b.c_j);
+            evaluate_lanes(b.r2,p,b.c_j);
+        }
+    }
+
+    template <typename Particles>
+    void all_pairs(Particles& particles1, const Particles& particles2) const {
+        #pragma omp parallel for
+        for (size_t i=0; i<particles1.size(); ++i) {
+            const int si = species_index(get<species>(particles1)[i]);
+            for (size_t j=0; j<particles2.size(); ++j) {
+                const int k = pair_index(si,species_index(get<species>(particles2)[j]));
+                if (m_cutoff2[k] < 0) continue;
+                const double_d dx = get<position>(particles2)[j]-get<position>(particles1)[i];
+                const double r2 = dx.squaredNorm();
+                if (r2 != 0) {
+                    get<force>(particles1)[i] += force_over_r(r2,k)*dx;
+                }
+            }
+        }
+    }
 
+private:
+    /// Gathers the parameters of the pairs \p ij into \p p, and sets \p c
+    /// to one for the pairs within their cutoff and zero otherwise.
+    void gather(const pair_block<D>& b, const int* ij, lanes& p, double* c) const {
+        for (int k=0; k<simd_block_size; ++k) {
+            c[k] = b.r2[k] <= m_cutoff2[ij[k]];
+            p.Ca_la[k] = m_Ca_la[ij[k]];
+            p.inv_la[k] = m_inv_la[ij[k]];
+            p.Cr_lr[k] = m_Cr_lr[ij[k]];
+            p.inv_lr[k] = m_inv_lr[ij[k]];
+        }
+    }
+
+    SPARPY_SIMD_TARGET
+    static void evaluate_lanes(const double* r2, const lanes& p, double* c) {
+        #pragma omp simd
+        for (int k=0; k<simd_block_size; ++k) {
+            const double r = std::sqrt(r2[k]);
+            c[k] *= (p.Ca_la[k]*simd_exp(-r*p.inv_la[k])
+                     - p.Cr_lr[k]*simd_exp(-r*p.inv_lr[k]))/r;
+        }
+    }
+};
 
+/// Several pair forces acting between the same two particle sets, evaluated
+/// in a single pass.
+///
+/// The neighbours are searched once using the largest cutoff of the attached
+/// forces, and each block of pairs is passed to every force in turn, which
+/// masks out the pairs beyond its own cutoff or with non-interacting species.
+/// The forces are summed per pair before being added to the particles, so
+/// the neighbour search, the gather of the separations and the scatter of the
+/// forces are only done once however many forces are attached.
+///
+/// A skin larger than zero caches the neighbours in a `verlet_list` (a half
+/// list if \p half is set, for a self-interaction), which is rebuilt when
+/// the cutoff grows by adding a force.
 template <unsigned int D>
-struct lennard_jones_force {
-    typedef ParticlesType<D> particles_type;
-    typedef Vector<double,D> double_d;
-    typedef typename particles_type::position position;
-    typedef force_d<D> force;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
+struct composite_force: public pair_force<composite_force<D>,D> {
+    typedef pair_force<composite_force<D>,D> base;
+    typedef std::tuple<std::vector<exponential_force<D>>,
+                       std::vector<morse_force<D>>,
+                       std::vector<yukawa_force<D>>,
+                       std::vector<lennard_jones_force<D>>,
+                       std::vector<morse_matrix_force<D>>> forces_storage_type;
 
     double m_cutoff;
-    double m_epsilon;
-    lennard_jones_force(const double cutoff, const double epsilon):
-        m_cutoff(cutoff),m_epsilon(epsilon)
+    forces_storage_type m_forces;
+    verlet_list<D> m_list;
+
+    composite_force(const double skin, const bool half):
+        base(false),
+        m_cutoff(0),m_list(0,skin,half)
     {}
 
-    void operator()(particles_pointer particles1, particles_pointer particles2) {
-        Symbol<position> p;
-        Symbol<force> f;
-        Symbol<id> id_;
-        Label<0,particles_type> a(*particles1);
-        Label<1,particles_type> b(*particles2);
-        auto dx = create_dx(a,b);
-        AccumulateWithinDistance<std::plus<double_d> > sum(m_cutoff);
+    template <typename F>
+    void add(const F& calc_force) {
+        std::get<std::vector<F>>(m_forces).push_back(calc_force);
+        if (calc_force.m_cutoff > m_cutoff) {
+            m_cutoff = calc_force.m_cutoff;
+            m_list = verlet_list<D>(m_cutoff,m_list.m_skin,m_list.m_half);
+        }
+    }
+
+    void set_skin(const double skin) {
+        m_list = verlet_list<D>(m_cutoff,skin,m_list.m_half);
+    }
+
+    /// Rebuilds the verlet list (if any) on the next evaluation, for when
+    /// the particles have been reordered.
+    void invalidate() {
+        m_list.invalidate();
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for_each_force([&](const auto& calc_force) { ++n; });
+        return n;
+    }
+
+    template <typename Particles>
+    void operator()(std::shared_ptr<Particles> particles1, std::shared_ptr<Particles> particles2) {
+        if (m_list.m_skin > 0) {
+            m_list.update(*particles1,*particles2);
+            if (m_list.m_half) {
+                this->symmetric_verlet_search(*particles1,m_list);
+            } else {
+                this->verlet_search(*particles1,*particles2,m_list);
+            }
+        } else if (particles1 == particles2) {
+            this->symmetric_neighbour_search(*particles1);
+        } else {
+            this->neighbour_search(*particles1,*particles2);
+        }
+    }
+
+    double search_radius(const double species_i) const {
+        double radius = 0;
+        for_each_force([&](const auto& calc_force) {
+            radius = std::max(radius,calc_force.search_radius(species_i));
+        });
+        return radius;
+    }
+
+    /// Sums `evaluate_pairs` of all the attached forces.
+    void evaluate_pairs(pair_block<D>& b, const double species_i) const {
+        double c_i[simd_block_size] = {};
+        double c_j[simd_block_size] = {};
+        for_each_force([&](const auto& calc_force) {
+            calc_force.evaluate_pairs(b,species_i);
+            for (int k=0; k<b.n; ++k) {
+                c_i[k] += b.c_i[k];
+                c_j[k] += b.c_j[k];
+            }
+        });
+        for (int k=0; k<b.n; ++k) {
+            b.c_i[k] = c_i[k];
+            b.c_j[k] = c_j[k];
+        }
+    }
+
+private:
+    template <typename F>
+    void for_each_force(F f) const {
+        for_each_force(f,std::make_index_sequence<std::tuple_size<forces_storage_type>::value>());
+    }
 
-        f[a] += sum(b,if_else(norm(dx)!=0, (1.0/dot(dx,dx))*(
-                                    12*pow(m_epsilon/norm(dx),12) 
-                                  - 6 *pow(m_epsilon/norm(dx), 6)
-                                                           ),0)*dx);
+    template <typename F, size_t... I>
+    void for_each_force(F f, std::index_sequence<I...>) const {
+        auto for_each = [&](const auto& forces) {
+            for (const auto& calc_force: forces) {
+                f(calc_force);
+            }
+        };
+        (void)std::initializer_list<int>{(for_each(std::get<I>(m_forces)),0)...};
     }
 };
 
 template <unsigned int D>
 struct hard_sphere {
-    typedef ParticlesType<D> particles_type;
     typedef Vector<double,D> double_d;
-    typedef typename particles_type::position position;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
+    typedef position_d<D> position;
     typedef force_d<D> force;
 
     double m_diameter;
@@ -166,12 +886,13 @@ struct hard_sphere {
         m_diameter(2*radius)
     {}
 
-    void operator()(particles_pointer particles1, particles_pointer particles2) {
+    template <typename Particles>
+    void operator()(std::shared_ptr<Particles> particles1, std::shared_ptr<Particles> particles2) {
         Symbol<position> p;
         Symbol<force> f;
         Symbol<id> id_;
-        Label<0,particles_type> a(*particles1);
-        Label<1,particles_type> b(*particles2);
+        Label<0,Particles> a(*particles1);
+        Label<1,Particles> b(*particles2);
         auto dx = create_dx(a,b);
         AccumulateWithinDistance<std::plus<double_d> > sum(m_diameter);
 
@@ -181,13 +902,9 @@ struct hard_sphere {
 
 template <unsigned int D>
 struct calculate_density {
-  typedef ParticlesType<D> particles_type;
   typedef Vector<double,D> double_d;
-  typedef typename particles_type::position position;
-  typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
+  typedef position_d<D> position;
   typedef force_d<D> force;
-  typedef typename particles_type::reference reference;
-  typedef typename particles_type::const_reference const_reference;
   
   double m_radius;
   double m_dt;
@@ -195,14 +912,16 @@ struct calculate_density {
     m_radius(radius),m_dt(dt)
   {}
   
-  void operator()(particles_pointer particles1, particles_pointer particles2) {
-    for (reference i: *particles1) {
-      for (const auto& tpl: euclidean_search(particles2->get_query(),get<position>(i),m_radius)) {
-        const_reference j = std::get<0>(tpl);
-        const double_d& dx = std::get<1>(tpl);
-        const double r2 = dx.squaredNorm();
-        get<density>(i)[get<species>(j)] += m_dt;
-      }
+  template <typename Particles>
+  void operator()(std::shared_ptr<Particles> particles1, std::shared_ptr<Particles> particles2) {
+    const double* s2 = get<species>(*particles2).data();
+    #pragma omp parallel for schedule(dynamic,64)
+    for (size_t i=0; i<particles1->size(); ++i) {
+      double4& density_i = get<density>(*particles1)[i];
+      for_each_neighbour(particles2->get_query(),get<position>(*particles1)[i],m_radius,
+        [&](const size_t j, const double_d&, const double) {
+          density_i[s2[j]] += m_dt;
+        });
     }
   }
 };
@@ -0,0 +1,146 @@
+#ifndef NEIGHBOUR_QUERIES_H_
+#define NEIGHBOUR_QUERIES_H_
+
+#include "sparpy.h"
+
+namespace sparpy {
+
+/// Batched neighbour queries on the neighbour search of a particle set, for
+/// many query points at once.
+///
+/// The results are in compressed sparse row (CSR) form: the neighbours of
+/// query point i are `indices[offsets[i]:offsets[i+1]]`, at distances
+/// `distances[offsets[i]:offsets[i+1]]`, where an index is the position of
+/// the particle in the particle set. The queries are independent and are run
+/// in parallel, so the particle set must not change while they run.
+template <typename ParticlesType>
+struct neighbour_queries {
+    typedef typename ParticlesType::query_type query_type;
+    typedef typename ParticlesType::double_d double_d;
+    typedef typename ParticlesType::position position;
+    static const unsigned int dimension = ParticlesType::dimension;
+
+    /// Sets `offsets[i+1]-offsets[i]` to the number of particles within
+    /// \p radius of each of the \p m \p points, with `offsets[0] = 0`
+    static void count_within(const ParticlesType& particles,
+                             const double_d* points, const size_t m,
+                             const double radius, size_t* offsets) {
+        const query_type& query = particles.get_query();
+        offsets[0] = 0;
+        #pragma omp parallel for
+        for (size_t i=0; i<m; ++i) {
+            size_t count = 0;
+            for_each_neighbour(query,points[i],radius,
+                [&](const size_t, const double_d&, const double) {
+                    ++count;
+                });
+            offsets[i+1] = count;
+        }
+        for (size_t i=0; i<m; ++i) {
+            offsets[i+1] += offsets[i];
+        }
+    }
+
+    /// Fills in the indices and distances of the particles within \p radius
+    /// of each of the \p m \p points, given the \p offsets from
+    /// count_within()
+    static void find_within(const ParticlesType& particles,
+                            const double_d* points, const size_t m,
+                            const double radius, const size_t* offsets,
+                            size_t* indices, double* distances) {
+        const query_type& query = particles.get_query();
+        #pragma omp parallel for
+        for (size_t i=0; i<m; ++i) {
+            size_t n = offsets[i];
+            for_each_neighbour(query,points[i],radius,
+                [&](const size_t j, const double_d&, const double r2) {
+                    indices[n] = j;
+                    distances[n] = std::sqrt(r2);
+                    ++n;
+                });
+        }
+    }
+
+    /// Fills in the indices and distances of the \p k nearest particles to
+    /// each of the \p m \p points, nearest first, so the offsets are `i*k`.
+    /// \p k must not be larger than the number of particles.
+    ///
+    /// There is no k-nearest search on the neighbour search structures, so
+    /// each query searches within a radius that starts where k particles are
+    /// expected for a uniform density, and doubles until at least k
+    /// particles are found. A particle can be found more than once through
+    /// different periodic images once the radius is over half the domain, in
+    /// which case only its nearest image is kept. The radius stops growing
+    /// once it reaches every particle in the domain, and any neighbours that
+    /// are still missing (e.g. for a NaN point) get the index
+    /// `particles.size()` and an infinite distance.
+    static void find_nearest(const ParticlesType& particles,
+                             const double_d* points, const size_t m,
+                             const size_t k,
+                             size_t* indices, double* distances) {
+        if (k == 0) return;
+        const query_type& query = particles.get_query();
+        const double_d& low = query.get_bounds().bmin;
+        const double_d& high = query.get_bounds().bmax;
+        const double_d width = high-low;
+        const double initial_radius =
+            std::pow(width.prod()*k/particles.size(),1.0/dimension);
+        #pragma omp parallel
+        {
+            std::vector<std::pair<double,size_t>> candidates;
+            #pragma omp for
+            for (size_t i=0; i<m; ++i) {
+                // all the particles are within the diagonal of the domain
+                // of the point closest to points[i] in the domain
+                double_d outside;
+                for (size_t d=0; d<dimension; ++d) {
+                    outside[d] = std::max(low[d]-points[i][d],
+                                          std::max(points[i][d]-high[d],0.0));
+                }
+                const double max_radius = width.norm() + outside.norm();
+                double radius = initial_radius > 0 ? initial_radius : max_radius;
+                for (;;) {
+                    candidates.clear();
+                    for_each_neighbour(query,points[i],radius,
+                        [&](const size_t j, const double_d&, const double r2) {
+                            candidates.emplace_back(r2,j);
+                        });
+                    // also true for a NaN point
+                    const bool last = !(radius < max_radius);
+                    if (candidates.size() >= k || last) {
+                        remove_duplicate_images(candidates);
+                        if (candidates.size() >= k || last) break;
+                    }
+                    radius = std::min(2*radius,max_radius);
+                }
+                const size_t found = std::min(k,candidates.size());
+                std::partial_sort(candidates.begin(),candidates.begin()+found,
+                                  candidates.end());
+                for (size_t n=0; n<found; ++n) {
+                    indices[i*k+n] = candidates[n].second;
+                    distances[i*k+n] = std::sqrt(candidates[n].first);
+                }
+                for (size_t n=found; n<k; ++n) {
+                    indices[i*k+n] = particles.size();
+                    distances[i*k+n] = std::numeric_limits<double>::infinity();
+                }
+            }
+        }
+    }
+
+private:
+    static void remove_duplicate_images(std::vector<std::pair<double,size_t>>& candidates) {
+        std::sort(candidates.begin(),candidates.end(),
+            [](const std::pair<double,size_t>& a, const std::pair<double,size_t>& b) {
+                return a.second < b.second || (a.second == b.second && a.first < b.first);
+            });
+        candidates.erase(std::unique(candidates.begin(),candidates.end(),
+            [](const std::pair<double,size_t>& a, const std::pair<double,size_t>& b) {
+                return a.second == b.second;
+            }),candidates.end());
+    }
+};
+
+}
+
+#endif
@@ -12,6 +12,8 @@ using namespace sparpy;
 
 BOOST_PYTHON_MODULE(sparpy) {
 
+    np::initialize();
+
 	VTK_PYTHON_CONVERSION(vtkUnstructuredGrid);
 
     #define ADD_PROPERTY(name_string, name, D) \
@@ -26,8 +28,65 @@ BOOST_PYTHON_MODULE(sparpy) {
 									return_value_policy<copy_non_const_reference>()), \
 					&set_data<name,ParticlesType<D>::reference>)
 
+    #define ADD_COLUMN(name_string, name, D, SearchMethod) \
+		.add_property(name_string, &get_column<name,ParticlesType<D,SearchMethod>>, \
+					&set_column<name,ParticlesType<D,SearchMethod>>)
 
+    #define WITHOUT_GIL(...) &without_gil<decltype(__VA_ARGS__),__VA_ARGS__>::call
 
+    // the particle set and simulation classes using the neighbour search
+    // SearchMethod, named e.g. "Particles2" suffix
+    #define ADD_SEARCH(D, SearchMethod, suffix) \
+        class_<ParticlesType<D,SearchMethod>,std::shared_ptr<ParticlesType<D,SearchMethod>>>("Particles"#D suffix) \
+            .def("__init__", make_constructor(&make_particles<D,SearchMethod>,  \
+                        default_call_policies(),                                \
+                        (arg("position"), arg("velocity")=object(),             \
+                         arg("species")=object())))                             \
+            .def("__init__", make_constructor(&make_zero_particles<D,SearchMethod>)) \
+            .def("__getitem__", &getitem_particles<ParticlesType<D,SearchMethod>>) \
+            .def("__setitem__", &setitem_particles_from_reference<ParticlesType<D,SearchMethod>>) \
+            .def("__setitem__", &setitem_particles_from_value<ParticlesType<D,SearchMethod>>)     \
+            .def("__len__", &ParticlesType<D,SearchMethod>::size)               \
+            .def("init_neighbour_search",WITHOUT_GIL(&ParticlesType<D,SearchMethod>::init_neighbour_search))\
+            .def("set_seed",&ParticlesType<D,SearchMethod>::set_seed)           \
+            .def("get_grid",&ParticlesType<D,SearchMethod>::get_grid,           \
+									return_value_policy<return_by_value>()) \
+            .def("append",&particles_push_back<ParticlesType<D,SearchMethod>>)  \
+            .def("extend",&particles_extend<D,SearchMethod>,                    \
+                        (arg("position"), arg("velocity")=object(),             \
+                         arg("species")=object()))                              \
+            .def("update_positions",WITHOUT_GIL(&ParticlesType<D,SearchMethod>::update_positions)) \
+            .def("find_neighbours",&find_neighbours<D,SearchMethod>,            \
+                        (arg("points"), arg("radius")))                         \
+            .def("find_nearest_neighbours",&find_nearest_neighbours<D,SearchMethod>, \
+                        (arg("points"), arg("k")))                              \
+            .def("column_view",&column_view<D,SearchMethod>,                    \
+                        (arg("name")))                                          \
+            .add_property("id", &get_column<id,ParticlesType<D,SearchMethod>>)  \
+            ADD_COLUMN("position",position_d<D>,D,SearchMethod)                 \
+            ADD_COLUMN("velocity",velocity_d<D>,D,SearchMethod)                 \
+            ADD_COLUMN("scalar",scalar,D,SearchMethod)                          \
+            ADD_COLUMN("density",density,D,SearchMethod)                        \
+            ADD_COLUMN("species",species,D,SearchMethod)                        \
+            ADD_COLUMN("force",force_d<D>,D,SearchMethod)                       \
+            ;                                                                   \
+                                                                                \
+        class_<Simulation<D,SearchMethod>>("Simulation"#D suffix,init<>())     \
+            .def("add_force", &Simulation<D,SearchMethod>::add_force<exponential_force<D>>)   \
+            .def("add_force", &Simulation<D,SearchMethod>::add_force<morse_force<D>>)   \
+            .def("add_force", &Simulation<D,SearchMethod>::add_force<lennard_jones_force<D>>)   \
+            .def("add_force", &Simulation<D,SearchMethod>::add_force<yukawa_force<D>>)   \
+            .def("add_force", &Simulation<D,SearchMethod>::add_force<morse_matrix_force<D>>)   \
+            .def("add_action", &Simulation<D,SearchMethod>::add_action<calculate_density<D>>)   \
+            .def("set_domain", &Simulation<D,SearchMethod>::set_domain)   \
+            .def("set_skin", &Simulation<D,SearchMethod>::set_skin)   \
+            .def("set_threads", &Simulation<D,SearchMethod>::set_threads)   \
+            .def("set_reorder_interval", &Simulation<D,SearchMethod>::set_reorder_interval)   \
+            .def("reorder_particles", WITHOUT_GIL(&Simulation<D,SearchMethod>::reorder_particles))   \
+            .def("add_particles", &Simulation<D,SearchMethod>::add_particles)   \
+            .def("integrate", WITHOUT_GIL(&Simulation<D,SearchMethod>::integrate))   \
+            .def("update_grid", WITHOUT_GIL(&Simulation<D,SearchMethod>::update_grid))   \
+            ;                                                                   \
 
     #define ADD_DIMENSION(D) \
         VectFromPythonList<double,D>(); \
@@ -37,18 +96,12 @@ BOOST_PYTHON_MODULE(sparpy) {
             Vector<double,D>,           \
             VectToPython<double,D> >(); \
                                         \
-        class_<ParticlesType<D>,std::shared_ptr<ParticlesType<D>>>("Particles"#D) \
-            .def(init<size_t>())                                                \
-            .def("__getitem__", &getitem_particles<ParticlesType<D>>)           \
-            .def("__setitem__", &setitem_particles_from_reference<ParticlesType<D>>) \
-            .def("__setitem__", &setitem_particles_from_value<ParticlesType<D>>)     \
-            .def("__len__", &ParticlesType<D>::size)     \
-            .def("init_neighbour_search",&ParticlesType<D>::init_neighbour_search)\
-            .def("get_grid",&ParticlesType<D>::get_grid,   \
-									return_value_policy<return_by_value>()) \
-            .def("append",&particles_push_back<ParticlesType<D>>)                          \
-            ;                                                                   \
-                                                                                    \
+        ADD_SEARCH(D,bucket_search_serial,"")                                   \
+        ADD_SEARCH(D,bucket_search_parallel,"_bucket_search_parallel")          \
+        ADD_SEARCH(D,bucket_search_hash,"_bucket_search_hash")                  \
+        ADD_SEARCH(D,octtree,"_octtree")                                        \
+        ADD_SEARCH(D,nanoflann_adaptor,"_nanoflann_adaptor")                    \
+                                                                                \
         class_<ParticlesType<D>::reference >("ParticleRef"#D,no_init) \
             ADD_PROPERTY_REF("id",id,D)                               \
             ADD_PROPERTY_REF("position",position_d<D>,D)              \
@@ -70,28 +123,24 @@ BOOST_PYTHON_MODULE(sparpy) {
             ADD_PROPERTY("force",force_d<D>,D)          \
             ;                                            \
                                                         \
-        class_<Simulation<D>>("Simulation"#D,init<>()) \
-            .def("add_force", &Simulation<D>::add_force<exponential_force<D>>)   \
-            .def("add_force", &Simulation<D>::add_force<morse_force<D>>)   \
-            .def("add_force", &Simulation<D>::add_force<lennard_jones_force<D>>)   \
-            .def("add_force", &Simulation<D>::add_force<yukawa_force<D>>)   \
-            .def("add_action", &Simulation<D>::add_action<calculate_density<D>>)   \
-            .def("set_domain", &Simulation<D>::set_domain)   \
-            .def("add_particles", &Simulation<D>::add_particles)   \
-            .def("integrate", &Simulation<D>::integrate)   \
-            .def("update_grid", &Simulation<D>::integrate)   \
-            ;                                            \
-                                                        \
-        class_<exponential_force<D>>("exponential_force"#D,init<double,double>()) \
+        class_<exponential_force<D>>("exponential_force"#D,init<double,double,optional<bool>>()) \
+            .def("tabulate", WITHOUT_GIL(&tabulate_force<exponential_force<D>>)) \
             ;                                            \
                                                         \
-        class_<morse_force<D>>("morse_force"#D,init<double,double,double,double,double,double>()) \
+        class_<morse_force<D>>("morse_force"#D,init<double,double,double,double,double,double,optional<bool>>()) \
+            .def("tabulate", WITHOUT_GIL(&tabulate_force<morse_force<D>>)) \
             ;                                             \
                                                         \
-        class_<yukawa_force<D>>("yukawa_force"#D,init<double,double>()) \
+        class_<morse_matrix_force<D>>("morse_matrix_force"#D,init<int,optional<bool>>()) \
+            .def("set", &morse_matrix_force<D>::set) \
+            ;                                            \
+                                                        \
+        class_<yukawa_force<D>>("yukawa_force"#D,init<double,double,optional<bool>>()) \
+            .def("tabulate", WITHOUT_GIL(&tabulate_force<yukawa_force<D>>)) \
             ;                                            \
                                                         \
-        class_<lennard_jones_force<D>>("lennard_jones_force"#D,init<double,double>()) \
+        class_<lennard_jones_force<D>>("lennard_jones_force"#D,init<double,double,optional<bool>>()) \
+            .def("tabulate", WITHOUT_GIL(&tabulate_force<lennard_jones_force<D>>)) \
             ;                                            \
                                                         \
         class_<calculate_density<D>>("calculate_density"#D,init<double,double>()) \
@@ -103,6 +152,6 @@ BOOST_PYTHON_MODULE(sparpy) {
     ADD_DIMENSION(2)
     ADD_DIMENSION(3)
     ADD_DIMENSION(4)
-    //.def("copy_from_vtk_grid",&ParticlesType<D>::copy_from_vtk_grid)      \
+    //.def("copy_from_vtk_grid",&ParticlesType<D>::copy_from_vtk_grid)
 
 }
@@ -11,9 +11,13 @@
 #include "sparpy.h"
 #include <boost/python/suite/indexing/vector_indexing_suite.hpp>
 #include <boost/python/suite/indexing/map_indexing_suite.hpp>
+#include <boost/python/numpy.hpp>
+#include <cstring>
 
 namespace sparpy {
 
+namespace np = boost::python::numpy;
+
 template<typename T, unsigned int D>
 struct VectFromPythonList
 {
@@ -34,8 +38,6 @@ struct VectFromPythonList
 	static void construct(
 			PyObject* obj_ptr,
 			boost::python::converter::rvalue_from_python_stage1_data* data) {
-		const int size = PyList_Size(obj_ptr);
-
 		// Grab pointer to memory into which to construct the new QString
 		void* storage = (
 				(boost::python::converter::rvalue_from_python_storage<Vector<T,D> >*)
@@ -126,6 +128,149 @@ void particles_push_back(ParticlesType& p, const typename ParticlesType::value_t
 }
 
 
+/// Converts \p obj to a C-contiguous array of doubles of shape (\p rows,D),
+/// or (\p rows,) if D is 0. A negative \p rows matches any number of rows.
+/// Raises a ValueError naming the argument \p name if the shape is wrong
+template <unsigned int D>
+np::ndarray to_double_array(const object& obj, const char* name, const Py_intptr_t rows=-1) {
+    const int nd = D == 0 ? 1 : 2;
+    np::ndarray array = np::from_object(obj, np::dtype::get_builtin<double>(), 
+                                        nd, nd, np::ndarray::C_CONTIGUOUS);
+    if ((rows >= 0 && array.shape(0) != rows) || (D > 0 && array.shape(1) != D)) {
+        PyErr_SetString(PyExc_ValueError, 
+                (std::string(name) + " array has the wrong shape").c_str());
+        throw boost::python::error_already_set();
+    }
+    return array;
+}
+
+template <typename T, typename ParticlesType>
+void zero_column(ParticlesType& p, const size_t begin) {
+    typedef typename T::value_type value_type;
+    std::fill(get<T>(p).begin() + begin, get<T>(p).end(), value_type(0));
+}
+
+/// Zeros all the variables of the particles in \p p from index \p begin. 
+/// Particles(n) leaves them uninitialised, since Vector has a trivial 
+/// default constructor
+template <unsigned int D, template <typename> class SearchMethod>
+void zero_columns(ParticlesType<D,SearchMethod>& p, const size_t begin=0) {
+    zero_column<typename ParticlesType<D,SearchMethod>::position>(p,begin);
+    zero_column<velocity_d<D>>(p,begin);
+    zero_column<force_d<D>>(p,begin);
+    zero_column<density>(p,begin);
+    zero_column<scalar>(p,begin);
+    zero_column<species>(p,begin);
+}
+
+/// Sets the positions of the particles in \p p from index \p begin to the
+/// rows of the (n,D) array \p x, and their velocities and species to the 
+/// optional (n,D) array \p velocity and (n,) array \p species (left 
+/// unchanged if None), where n is the number of particles from \p begin. 
+/// The columns are filled by copying the arrays
+template <unsigned int D, template <typename> class SearchMethod>
+void set_columns(ParticlesType<D,SearchMethod>& p, const np::ndarray& x, 
+                 const object& velocity, const object& species, 
+                 const size_t begin=0) {
+    typedef typename ParticlesType<D,SearchMethod>::position position;
+    typedef Vector<double,D> double_d;
+    const size_t n = p.size() - begin;
+
+    std::memcpy(get<position>(p).data() + begin, x.get_data(), n*sizeof(double_d));
+
+    if (!velocity.is_none()) {
+        np::ndarray array = to_double_array<D>(velocity,"velocity",n);
+        std::memcpy(get<velocity_d<D>>(p).data() + begin, array.get_data(), n*sizeof(double_d));
+    }
+
+    if (!species.is_none()) {
+        np::ndarray array = to_double_array<0>(species,"species",n);
+        std::memcpy(get<sparpy::species>(p).data() + begin, array.get_data(), n*sizeof(double));
+    }
+}
+
+/// Releases the GIL for its lifetime, so that other Python threads can run
+/// while a long C++ call is in progress. No Python object may be touched
+/// while it is in scope.
+struct scoped_gil_release {
+    scoped_gil_release():m_state(PyEval_SaveThread()) {}
+    ~scoped_gil_release() { PyEval_RestoreThread(m_state); }
+    PyThreadState* m_state;
+};
+
+/// Appends one particle for each row of the (n,D) array \p position, see
+/// set_columns(). The container is resized once, the columns are copied 
+/// straight from the arrays and the neighbour search is updated once for 
+/// all the new particles
+template <unsigned int D, template <typename> class SearchMethod>
+void particles_extend(ParticlesType<D,SearchMethod>& p, const object& position, 
+                      const object& velocity, const object& species) {
+    // check the shapes before the container grows
+    np::ndarray x = to_double_array<D>(position,"position");
+    const size_t n = x.shape(0);
+    const object v = velocity.is_none() ? velocity 
+                                        : object(to_double_array<D>(velocity,"velocity",n));
+    const object s = species.is_none() ? species 
+                                       : object(to_double_array<0>(species,"species",n));
+
+    const size_t old_size = p.size();
+    p.resize(old_size + n);
+    zero_columns(p,old_size);
+    set_columns(p,x,v,s,old_size);
+    scoped_gil_release release;
+    p.add_points_at_end(old_size);
+}
+
+/// Constructs a particle set with one particle for each row of the (n,D)
+/// array \p position, see set_columns()
+template <unsigned int D, template <typename> class SearchMethod>
+std::shared_ptr<ParticlesType<D,SearchMethod>> make_particles(const object& position, 
+                                   const object& velocity, const object& species) {
+    np::ndarray x = to_double_array<D>(position,"position");
+    auto p = std::make_shared<ParticlesType<D,SearchMethod>>(x.shape(0));
+    zero_columns(*p);
+    set_columns(*p,x,velocity,species);
+    return p;
+}
+
+/// Constructs a particle set of \p n particles at the origin, with all their
+/// variables zeroed
+template <unsigned int D, template <typename> class SearchMethod>
+std::shared_ptr<ParticlesType<D,SearchMethod>> make_zero_particles(const size_t n) {
+    auto p = std::make_shared<ParticlesType<D,SearchMethod>>(n);
+    zero_columns(*p);
+    return p;
+}
+
+
+template <typename Force>
+double tabulate_force(Force& f, const size_t n) {
+    return f.tabulate(n);
+}
+
+/// Wraps the function or member function \p f so that it is called with the
+/// GIL released. Boost.Python converts all the arguments before `call` is
+/// entered and the result after it returns, so \p f only sees C++ objects.
+template <typename F, F f>
+struct without_gil;
+
+template <typename R, typename... Args, R (*f)(Args...)>
+struct without_gil<R (*)(Args...), f> {
+    static R call(Args... args) {
+        scoped_gil_release release;
+        return f(std::forward<Args>(args)...);
+    }
+};
+
+template <typename R, typename T, typename... Args, R (T::*f)(Args...)>
+struct without_gil<R (T::*)(Args...), f> {
+    static R call(T& self, Args... args) {
+        scoped_gil_release release;
+        return (self.*f)(std::forward<Args>(args)...);
+    }
+};
+
+
 template<class T>
 struct vtkSmartPointer_to_python {
 	static PyObject *convert(const vtkSmartPointer<T> &p) {
@@ -210,6 +355,165 @@ void set_data(VT & arg, const typename T::value_type & data) {
     get<T>(arg) = data;
 }
 
+/// NumPy array of shape (n,) viewing the \p n values at \p data, which keeps
+/// \p owner alive for as long as the array exists
+template <typename T>
+np::ndarray make_column_view(T* data, const size_t n, const object& owner) {
+    return np::from_data(data, np::dtype::get_builtin<T>(),
+                         make_tuple(n), make_tuple(sizeof(T)), owner);
+}
+
+/// NumPy array of shape (n,N) viewing the \p n vectors at \p data
+template <typename T, unsigned int N>
+np::ndarray make_column_view(Vector<T,N>* data, const size_t n, const object& owner) {
+    return np::from_data(data, np::dtype::get_builtin<T>(),
+                         make_tuple(n,N), make_tuple(sizeof(Vector<T,N>),sizeof(T)), owner);
+}
+
+/// Returns the column of variable T of the particle set \p self as a NumPy
+/// array that shares its memory, so no values are copied. The array is only
+/// valid until the particles are added, removed or reordered (e.g. by
+/// `append` or `integrate`), and positions written through it are only seen
+/// by the neighbour search after `update_positions()`
+template<typename T, typename ParticlesType>
+np::ndarray get_column_view(const object& self) {
+    ParticlesType& particles = extract<ParticlesType&>(self);
+    return make_column_view(get<T>(particles).data(), particles.size(), self);
+}
+
+/// Returns a read-only copy of the column of variable T of the particle set
+/// \p self as a NumPy array, which stays valid whatever happens to the
+/// particles. See column_view() for an array that shares the memory
+template<typename T, typename ParticlesType>
+np::ndarray get_column(const object& self) {
+    np::ndarray column = get_column_view<T,ParticlesType>(self).copy();
+    column.attr("setflags")(false);
+    return column;
+}
+
+/// Number of values in each element of a column, 0 for a scalar
+template <typename T>
+struct column_width: std::integral_constant<unsigned int,0> {};
+
+template <typename T, unsigned int N>
+struct column_width<Vector<T,N>>: std::integral_constant<unsigned int,N> {};
+
+/// Sets the column of variable T of the particles in \p p by copying the
+/// array \p values, of shape (n,) for a scalar variable or (n,N) for a
+/// vector, where n is the number of particles. Setting the positions updates
+/// the neighbour search (if initialised), with the GIL released, which can
+/// remove particles outside a non-periodic domain or reorder them
+template<typename T, typename ParticlesType>
+void set_column(ParticlesType& p, const object& values) {
+    typedef typename T::value_type value_type;
+    np::ndarray array = to_double_array<column_width<value_type>::value>(
+                                                            values,"column",p.size());
+    std::memcpy(get<T>(p).data(), array.get_data(), p.size()*sizeof(value_type));
+    if (std::is_same<T,typename ParticlesType::position>::value) {
+        scoped_gil_release release;
+        p.update_positions();
+    }
+}
+
+/// Returns the column \p name of the particle set \p self as a NumPy array
+/// that shares its memory, see get_column_view(). Raises a ValueError if
+/// there is no such column
+template <unsigned int D, template <typename> class SearchMethod>
+np::ndarray column_view(const object& self, const std::string& name) {
+    typedef ParticlesType<D,SearchMethod> particles_type;
+    if (name == "id") return get_column_view<id,particles_type>(self);
+    if (name == "position") return get_column_view<position_d<D>,particles_type>(self);
+    if (name == "velocity") return get_column_view<velocity_d<D>,particles_type>(self);
+    if (name == "scalar") return get_column_view<scalar,particles_type>(self);
+    if (name == "density") return get_column_view<density,particles_type>(self);
+    if (name == "species") return get_column_view<species,particles_type>(self);
+    if (name == "force") return get_column_view<force_d<D>,particles_type>(self);
+    PyErr_SetString(PyExc_ValueError, ("no column named " + name).c_str());
+    throw boost::python::error_already_set();
+}
+
+/// Raises a ValueError unless the neighbour search of \p p has been
+/// initialised on a domain with a positive width in every dimension
+template <typename ParticlesType>
+void check_neighbour_search(const ParticlesType& p) {
+    if (!p.is_searchable()) {
+        PyErr_SetString(PyExc_ValueError,
+                "the neighbour search has not been initialised, call init_neighbour_search");
+        throw boost::python::error_already_set();
+    }
+    for (size_t d=0; d<ParticlesType::dimension; ++d) {
+        if (!(p.get_max()[d] > p.get_min()[d])) {
+            PyErr_SetString(PyExc_ValueError, "the neighbour search domain is empty");
+            throw boost::python::error_already_set();
+        }
+    }
+}
+
+/// Returns the CSR arrays (offsets, indices, distances) of the particles
+/// within \p radius of each row of the (m,D) array \p points, see
+/// neighbour_queries. The search is the one built at the last 
+/// update_positions(), and the GIL is released while it runs
+template <unsigned int D, template <typename> class SearchMethod>
+boost::python::tuple find_neighbours(const ParticlesType<D,SearchMethod>& p, 
+                                     const object& points, const double radius) {
+    typedef neighbour_queries<ParticlesType<D,SearchMethod>> queries;
+    typedef Vector<double,D> double_d;
+    check_neighbour_search(p);
+    np::ndarray x = to_double_array<D>(points,"points");
+    const size_t m = x.shape(0);
+    const double_d* xp = reinterpret_cast<const double_d*>(x.get_data());
+
+    np::ndarray offsets = np::empty(make_tuple(m+1), np::dtype::get_builtin<size_t>());
+    size_t* o = reinterpret_cast<size_t*>(offsets.get_data());
+    {
+        scoped_gil_release release;
+        queries::count_within(p,xp,m,radius,o);
+    }
+
+    np::ndarray indices = np::empty(make_tuple(o[m]), np::dtype::get_builtin<size_t>());
+    np::ndarray distances = np::empty(make_tuple(o[m]), np::dtype::get_builtin<double>());
+    {
+        scoped_gil_release release;
+        queries::find_within(p,xp,m,radius,o,
+                             reinterpret_cast<size_t*>(indices.get_data()),
+                             reinterpret_cast<double*>(distances.get_data()));
+    }
+    return make_tuple(offsets,indices,distances);
+}
+
+/// Returns the CSR arrays (offsets, indices, distances) of the \p k nearest
+/// particles to each row of the (m,D) array \p points, nearest first, see 
+/// find_neighbours()
+template <unsigned int D, template <typename> class SearchMethod>
+boost::python::tuple find_nearest_neighbours(const ParticlesType<D,SearchMethod>& p, 
+                                             const object& points, const size_t k) {
+    typedef neighbour_queries<ParticlesType<D,SearchMethod>> queries;
+    typedef Vector<double,D> double_d;
+    check_neighbour_search(p);
+    if (k > p.size()) {
+        PyErr_SetString(PyExc_ValueError, "k is larger than the number of particles");
+        throw boost::python::error_already_set();
+    }
+    np::ndarray x = to_double_array<D>(points,"points");
+    const size_t m = x.shape(0);
+    const double_d* xp = reinterpret_cast<const double_d*>(x.get_data());
+
+    np::ndarray offsets = np::empty(make_tuple(m+1), np::dtype::get_builtin<size_t>());
+    np::ndarray indices = np::empty(make_tuple(m*k), np::dtype::get_builtin<size_t>());
+    np::ndarray distances = np::empty(make_tuple(m*k), np::dtype::get_builtin<double>());
+    size_t* o = reinterpret_cast<size_t*>(offsets.get_data());
+    for (size_t i=0; i<=m; ++i) {
+        o[i] = i*k;
+    }
+    {
+        scoped_gil_release release;
+        queries::find_nearest(p,xp,m,k,
+                              reinterpret_cast<size_t*>(indices.get_data()),
+                              reinterpret_cast<double*>(distances.get_data()));
+    }
+    return make_tuple(offsets,indices,distances);
+}
+
 
 }
 
@@ -0,0 +1,63 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+/// Functions marked with SPARPY_SIMD_TARGET are compiled for AVX-512, AVX2
+/// and the default instruction set, with the best supported version chosen
+/// at runtime. Without HAVE_SIMD (or on compilers other than GCC) only the
+/// default version is built.
+#if defined(HAVE_SIMD) && defined(__GNUC__) && !defined(__clang__)
+#define SPARPY_SIMD_TARGET __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define SPARPY_SIMD_TARGET
+#endif
+
+namespace sparpy {
+
+/// Number of pairs evaluated together by the pair force kernels.
+const int simd_block_size = 8;
+
+/// Branch-free exponential that the compiler can vectorise, accurate to a
+/// few ulp. The argument is clamped to [-708,709], so it never returns zero
+/// or infinity.
+inline double simd_exp(double x) {
+    // clamp without a branch, x is unchanged (exactly) inside the range
+    x += 0.5*((-708.0 - x) + std::abs(-708.0 - x));
+    x -= 0.5*((x - 709.0) + std::abs(x - 709.0));
+
+    // x = n*ln(2) + r, with n rounded to nearest using the 1.5*2^52 trick
+    const double shift = 6755399441055744.0;
+    const double t = x*1.4426950408889634 + shift;
+    const double n = t - shift;
+    const double r = (x - n*6.93147180369123816490e-01) - n*1.90821492927058770002e-10;
+
+    // Taylor series of exp(r) for |r| <= ln(2)/2
+    double p = 1.0/479001600.0;
+    p = p*r + 1.0/39916800.0;
+    p = p*r + 1.0/3628800.0;
+    p = p*r + 1.0/362880.0;
+    p = p*r + 1.0/40320.0;
+    p = p*r + 1.0/5040.0;
+    p = p*r + 1.0/720.0;
+    p = p*r + 1.0/120.0;
+    p = p*r + 1.0/24.0;
+    p = p*r + 1.0/6.0;
+    p = p*r + 0.5;
+    p = p*r + 1.0;
+    p = p*r + 1.0;
+
+    // 2^n from the low bits of t
+    uint64_t bits;
+    std::memcpy(&bits,&t,sizeof(bits));
+    bits = (bits + 1023) << 52;
+    double scale;
+    std::memcpy(&scale,&bits,sizeof(scale));
+    return p*scale;
+}
+
+}
+
+#endif
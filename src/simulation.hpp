@@ -7,22 +7,33 @@
 
 namespace sparpy {
 
-template <unsigned int D>
+/// Simulation of particle sets in a D dimensional domain, with the
+/// neighbour search \p SearchMethod used for all the particle sets (see
+/// `ParticlesType`).
+template <unsigned int D, template <typename> class SearchMethod=bucket_search_serial>
 class Simulation {
-    typedef ParticlesType<D> particles_type;
-    typedef typename ParticlesType<D>::position position;
+    typedef ParticlesType<D,SearchMethod> particles_type;
+    typedef typename particles_type::position position;
     typedef force_d<D> force;
     typedef velocity_d<D> velocity;
     typedef Vector<double,D> double_d;
     typedef Vector<bool,D> bool_d;
-    typedef std::shared_ptr<ParticlesType<D>> particles_pointer;
+    typedef std::shared_ptr<particles_type> particles_pointer;
     typedef std::map<particles_pointer,double> particles_storage_type;
+    typedef std::set<particles_pointer> dirty_particles_storage_type;
     typedef std::vector<std::function<void()>> actions_storage_type;
     typedef std::vector<std::function<void()>> forces_storage_type;
+    typedef std::shared_ptr<composite_force<D>> composite_force_pointer;
+    typedef std::map<std::pair<particles_pointer,particles_pointer>,
+                     composite_force_pointer> pair_forces_storage_type;
 
     particles_storage_type particle_sets;
+    dirty_particles_storage_type dirty_particle_sets;
     actions_storage_type actions;
     forces_storage_type forces;
+    pair_forces_storage_type pair_forces;
+    double m_skin;
+    int m_threads;
     bool m_domain_has_been_set;
     double_d m_min;
     double_d m_max;
@@ -30,14 +41,57 @@ class Simulation {
     double_d m_max_reflect;
     bool_d m_periodic;
     int m_integrate_count;
+    int m_reorder_interval;
+    int m_steps_since_reorder;
 
 
+    template <typename F>
+    void add_force_impl(particles_pointer particles1, particles_pointer particles2, 
+            const F& calc_force, std::false_type) {
+        forces.push_back(std::bind(calc_force,particles1,particles2));
+    }
+
+    // pair forces between the same particle sets are grouped into one
+    // composite force, so that they share a single neighbour search
+    template <typename F>
+    void add_force_impl(particles_pointer particles1, particles_pointer particles2, 
+            const F& calc_force, std::true_type) {
+        if (calc_force.m_all_pairs) {
+            add_force_impl(particles1,particles2,calc_force,std::false_type());
+            return;
+        }
+        composite_force_pointer& composite = pair_forces[std::make_pair(particles1,particles2)];
+        if (!composite) {
+            composite = std::make_shared<composite_force<D>>(m_skin,particles1 == particles2);
+            composite_force_pointer shared = composite;
+            forces.push_back([=]() { (*shared)(particles1,particles2); });
+        }
+        composite->add(calc_force);
+    }
+
 public:
 
+    Simulation():
+        m_skin(0),m_threads(0),m_domain_has_been_set(false),
+        m_reorder_interval(0),m_steps_since_reorder(0)
+    {}
+
     template <typename F>
     void add_force(particles_pointer particles1, particles_pointer particles2, 
             const F& calc_force) {
-        forces.push_back(std::bind(calc_force,particles1,particles2));
+        add_force_impl(particles1,particles2,calc_force,
+                std::is_base_of<pair_force<F,D>,F>());
+    }
+
+    /// Set the skin distance of the verlet lists used by pair forces, which
+    /// applies to the forces already added as well as later ones. A skin of
+    /// zero (the default) disables the verlet lists and searches for
+    /// neighbours on every time step.
+    void set_skin(const double skin) {
+        m_skin = skin;
+        for (auto& composite: pair_forces) {
+            composite.second->set_skin(skin);
+        }
     }
     template <typename F>
     void add_action(particles_pointer particles1, particles_pointer particles2, 
@@ -45,6 +99,36 @@ public:
         actions.push_back(std::bind(calc_action,particles1,particles2));
     }
 
+    /// Set the number of OpenMP threads used by the forces and actions. Zero
+    /// (the default) uses the OpenMP default, and without OpenMP this has no
+    /// effect.
+    void set_threads(const int threads) {
+        m_threads = threads;
+    }
+
+    /// Reorder the particles along a Z-order curve every \p interval time
+    /// steps, so that neighbouring particles stay close in memory as they 
+    /// move around. Zero (the default) never reorders. This changes the 
+    /// order of the particles in each set, but not their ids.
+    void set_reorder_interval(const int interval) {
+        m_reorder_interval = interval;
+        m_steps_since_reorder = 0;
+    }
+
+    /// Reorders the particles of every set along a Z-order curve, see
+    /// `set_reorder_interval()`.
+    void reorder_particles() {
+        update_positions();
+        for (auto& particle_set: particle_sets) {
+            particle_set.first->reorder_morton();
+        }
+        // the verlet lists store particle indices
+        for (auto& composite: pair_forces) {
+            composite.second->invalidate();
+        }
+        m_steps_since_reorder = 0;
+    }
+
     void set_domain(const double_d& min, const double_d& max, const bool_d periodic) {
         m_integrate_count = 0;
         m_min = min;
@@ -92,44 +176,90 @@ public:
         p[a] += std::sqrt(2*diffusion_constant*dt)*vector(N[a],N[a],N[a]) + dt*f[a]/(1+norm(f[a])*dt);
         */
 
-        std::normal_distribution<double> N;
-
-        for (typename particles_type::reference i: *particles) {
-            double_d& p = get<position>(i);
-            double_d& f = get<force>(i);
-            double_d& v = get<velocity>(i);
-            auto& g = get<Aboria::random>(i);
-            //const double scale = 1.0/(1+f.norm()*dt);
-            const double diffusion = std::sqrt(2*diffusion_constant*dt);
-            const double beta = 100;
-            for (int i = 0; i < D; ++i) {
-                p[i] += dt*v[i];
-                v[i] += beta*diffusion*N(g) + dt*f[i] - beta*v[i]*dt;
+        // each particle draws from its own generator, so the result does not
+        // depend on the number of threads
+        double_d* x = get<position>(*particles).data();
+        double_d* v = get<velocity>(*particles).data();
+        const double_d* f = get<force>(*particles).data();
+        auto* g = get<Aboria::random>(*particles).data();
+        const double diffusion = std::sqrt(2*diffusion_constant*dt);
+        const double beta = 100;
+        #pragma omp parallel for
+        for (size_t i=0; i<particles->size(); ++i) {
+            std::normal_distribution<double> N;
+            //const double scale = 1.0/(1+f[i].norm()*dt);
+            for (int d = 0; d < D; ++d) {
+                x[i][d] += dt*v[i][d];
+                v[i][d] += beta*diffusion*N(g[i]) + dt*f[i][d] - beta*v[i][d]*dt;
             }
+            reflect(x[i]);
         }
-        particles->update_positions();
+        dirty_particle_sets.insert(particles);
     }
 
     void reflective_boundaries(particles_pointer particles) {
-        for (typename particles_type::reference i: *particles) {
-            double_d& p = get<position>(i);
-            for (int i = 0; i < D; ++i) {
-                if (!m_periodic[i]) {
-                    if (p[i] > m_max_reflect[i]) {
-                        p[i] = 2*m_max_reflect[i]-p[i];
-                    }
-                    if (p[i] < m_min_reflect[i]) {
-                        p[i] = 2*m_min_reflect[i]-p[i];
-                    }
+        double_d* x = get<position>(*particles).data();
+        #pragma omp parallel for
+        for (size_t i=0; i<particles->size(); ++i) {
+            reflect(x[i]);
+        }
+        dirty_particle_sets.insert(particles);
+    }
+
+    /// Updates the neighbour search of the particle sets whose positions have
+    /// changed since the last update. The position-changing stages only mark
+    /// the sets as dirty, so that the search is rebuilt once per time step,
+    /// right before it is next used.
+    void update_positions() {
+        if (dirty_particle_sets.empty()) return;
+        for (auto& particles: dirty_particle_sets) {
+            particles->update_positions();
+        }
+        dirty_particle_sets.clear();
+        // the verlet lists store particle indices
+        if (!keeps_particle_order<SearchMethod>::value) {
+            for (auto& composite: pair_forces) {
+                composite.second->invalidate();
+            }
+        }
+    }
+
+    /// Reflects \p p back into the domain along the non-periodic dimensions.
+    void reflect(double_d& p) const {
+        for (int i = 0; i < D; ++i) {
+            if (!m_periodic[i]) {
+                if (p[i] > m_max_reflect[i]) {
+                    p[i] = 2*m_max_reflect[i]-p[i];
+                }
+                if (p[i] < m_min_reflect[i]) {
+                    p[i] = 2*m_min_reflect[i]-p[i];
+                }
+                // a step of more than the width of the domain (e.g. from
+                // a strongly repulsive close pair) is still outside, so
+                // fold it back by reflecting off both boundaries repeatedly
+                if (p[i] > m_max_reflect[i]) {
+                    const double width = m_max_reflect[i]-m_min_reflect[i];
+                    const double t = std::fmod(p[i]-m_min_reflect[i],2*width);
+                    p[i] = t <= width ? m_min_reflect[i]+t : m_max_reflect[i]-(t-width);
                 }
-                
             }
         }
-        particles->update_positions();
     }
 
 
     void time_step(const double dt) {
+#ifdef HAVE_OPENMP
+        if (m_threads > 0) {
+            omp_set_num_threads(m_threads);
+        }
+#endif
+
+        // the neighbour search is out of date after the previous step
+        update_positions();
+        if (m_reorder_interval > 0 && ++m_steps_since_reorder >= m_reorder_interval) {
+            reorder_particles();
+        }
+
         // zero forces
         for (auto& particle_set: particle_sets) {
             Symbol<force> f;
@@ -142,22 +272,16 @@ public:
             calc_force();
         }
         
-        // integrate
+        // integrate, reflecting off the non-periodic boundaries
         for (auto& particle_set: particle_sets) {
             euler_integration(dt,particle_set.first,particle_set.second);
         }
 
         // calculate actions
+        update_positions();
         for (auto& calc_action: actions) {
             calc_action();
         }
-
-        // deal with reflective boundaries if needed
-        for (auto& particle_set: particle_sets) {
-            reflective_boundaries(particle_set.first);
-        }
-
-
     }
 
     void integrate(const double for_time, const double dt) {
@@ -167,6 +291,7 @@ public:
             time_step(dt);
         }
         time_step(remainder_dt);
+        update_positions();
         int i = 0;
         for (auto& particle_set: particle_sets) {
             std::string name =  "integrate_" + std::to_string(i) + "_";
@@ -177,19 +302,17 @@ public:
 
     }
     
+    /// Turns each coral (species 0) of \p particles into algae (species 1)
+    /// with probability `dt*c_to_t_rate`. No particle moves and the
+    /// simulation does not advance.
     void update_grid(particles_pointer particles, const double dt,
                      const double c_to_t_rate) {
      
       std::uniform_real_distribution<double> U;
       
       for (typename particles_type::reference i: *particles) {
-        double_d& p = get<position>(i);
-        double_d& f = get<force>(i);
-        double_d& v = get<velocity>(i);
         double& s = get<species>(i);
-        double& d = get<density>(i);
         auto& g = get<Aboria::random>(i);
-        //const double scale = 1.0/(1+f.norm()*dt);
         if (s == 0) {
           const double prob_of_death = dt*c_to_t_rate;
           if (U(g) < prob_of_death) {
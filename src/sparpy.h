@@ -14,13 +14,15 @@ ABORIA_VARIABLE(species, double, "species (0=coral, 1=algae, 2=turf, 3=fish)")
 ABORIA_VARIABLE(density, double4, "density")
 ABORIA_VARIABLE_VECTOR(force_d,double,"force")
 ABORIA_VARIABLE_VECTOR(velocity_d,double,"velocity")
-template <unsigned int D>
-using ParticlesType = Particles<std::tuple<scalar,species,density,velocity_d<D>,force_d<D>>,D>;
+template <unsigned int D, template <typename> class SearchMethod=bucket_search_serial>
+using ParticlesType = Particles<std::tuple<scalar,species,density,velocity_d<D>,force_d<D>>,
+                                D,std::vector,SearchMethod>;
 
 
 }
 
 #include "interactions.hpp"
 #include "simulation.hpp"
+#include "neighbour_queries.hpp"
 
 #endif
@@ -0,0 +1,124 @@
+#ifndef VERLET_LIST_H_
+#define VERLET_LIST_H_
+
+#include "sparpy.h"
+
+namespace sparpy {
+
+/// True for the neighbour searches that never reorder the particles of the
+/// set, so that their indices stay the same when the positions are updated.
+template <template <typename> class SearchMethod>
+struct keeps_particle_order: std::false_type {};
+
+template <>
+struct keeps_particle_order<bucket_search_serial>: std::true_type {};
+
+template <>
+struct keeps_particle_order<bucket_search_hash>: std::true_type {};
+
+/// Verlet neighbour list between two particle sets.
+///
+/// For each particle i in the first set the list holds every particle j of
+/// the second set within `cutoff + skin`, found using the neighbour search of
+/// the second set, together with the periodic shift that was applied to j.
+/// The list stays valid for any pair force with a cutoff up to `cutoff` until
+/// the particles have moved more than the skin in total, so `update()` only
+/// rebuilds it when the largest displacement in each set since the last build
+/// adds up to more than `skin` (i.e. half the skin for a self-interaction), or
+/// when the number of particles has changed.
+///
+/// A half list (\p half set, used for self-interactions where both sets are
+/// the same) only stores the neighbours j > i of each particle i, so that
+/// each unordered pair appears once.
+///
+/// The particle sets can use any neighbour search, but the list refers to
+/// the particles by index, so it must be invalidated when a search reorders
+/// them.
+template <unsigned int D>
+struct verlet_list {
+    typedef Vector<double,D> double_d;
+    typedef position_d<D> position;
+
+    double m_cutoff;
+    double m_skin;
+    bool m_half;
+    std::vector<size_t> m_offsets;
+    std::vector<size_t> m_neighbours;
+    std::vector<double_d> m_shifts;
+    std::vector<double_d> m_positions1;
+    std::vector<double_d> m_positions2;
+    int m_build_count;
+
+    verlet_list(const double cutoff, const double skin, const bool half=false):
+        m_cutoff(cutoff),m_skin(skin),m_half(half),m_build_count(0)
+    {}
+
+    template <typename Particles>
+    void update(const Particles& particles1, const Particles& particles2) {
+        if (needs_rebuild(particles1,particles2)) {
+            build(particles1,particles2);
+        }
+    }
+
+    template <typename Particles>
+    bool needs_rebuild(const Particles& particles1, const Particles& particles2) const {
+        if (m_build_count == 0
+                || m_positions1.size() != particles1.size()
+                || m_positions2.size() != particles2.size()) {
+            return true;
+        }
+        const double max_dx1 = max_displacement(m_positions1,particles1);
+        const double max_dx2 = &particles1 == &particles2 ?
+                                    max_dx1 : max_displacement(m_positions2,particles2);
+        return max_dx1 + max_dx2 > m_skin;
+    }
+
+    template <typename Particles>
+    void build(const Particles& particles1, const Particles& particles2) {
+        const double radius = m_cutoff + m_skin;
+        const double_d* x2 = get<position>(particles2).data();
+        m_offsets.resize(particles1.size()+1);
+        m_neighbours.clear();
+        m_shifts.clear();
+        m_offsets[0] = 0;
+        for (size_t i=0; i<particles1.size(); ++i) {
+            const double_d& xi = get<position>(particles1)[i];
+            for_each_neighbour(particles2.get_query(),xi,radius,
+                [&](const size_t j, const double_d& dx, const double) {
+                    if (m_half && j <= i) return;
+                    m_neighbours.push_back(j);
+                    m_shifts.push_back(dx - (x2[j] - xi));
+                });
+            m_offsets[i+1] = m_neighbours.size();
+        }
+        m_positions1 = get<position>(particles1);
+        m_positions2 = get<position>(particles2);
+        ++m_build_count;
+    }
+
+    /// Forces a rebuild on the next `update()`, for when the particles have
+    /// been reordered.
+    void invalidate() {
+        m_positions1.clear();
+        m_positions2.clear();
+    }
+
+    size_t size() const { return m_neighbours.size(); }
+    int get_build_count() const { return m_build_count; }
+
+private:
+    template <typename Particles>
+    static double max_displacement(const std::vector<double_d>& old_positions,
+                                   const Particles& particles) {
+        double max_r2 = 0;
+        for (size_t i=0; i<particles.size(); ++i) {
+            const double r2 = (get<position>(particles)[i]-old_positions[i]).squaredNorm();
+            if (r2 > max_r2) max_r2 = r2;
+        }
+        return std::sqrt(max_r2);
+    }
+};
+
+}
+
+#endif
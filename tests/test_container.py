@@ -1,3 +1,5 @@
+import numpy as np
+import pytest
 import sparpy
 
 def test_container_2d():
@@ -61,6 +63,136 @@ def test_append_container():
     assert particles[0].position[0] == 1
     assert particles[0].position[1] == 2
 
+def test_column_views():
+    particles = sparpy.Particles2(10)
+    positions = particles.column_view('position')
+    assert positions.shape == (10,2)
+    positions[3] = [1,2]
+    assert particles[3].position[0] == 1
+    assert particles[3].position[1] == 2
+
+    particles[4].position = [3,4]
+    assert positions[4,0] == 3
+    assert positions[4,1] == 4
+
+    with pytest.raises(ValueError):
+        particles.column_view('mass')
+
+def test_columns():
+    particles = sparpy.Particles2(10)
+    positions = particles.position
+    assert positions.shape == (10,2)
+    with pytest.raises(ValueError):
+        positions[3] = [1,2]
+
+    # the columns are copies, so they stay valid as particles are added
+    particles[4].position = [3,4]
+    particles.extend(np.ones((100,2)))
+    assert positions[4,0] == 0
+    assert particles.position[4,0] == 3
+    assert particles.position.shape == (110,2)
+
+    x = np.random.uniform(size=(110,2))
+    particles.position = x
+    assert np.all(particles.position == x)
+    species = np.arange(110,dtype=float)
+    particles.species = species
+    assert np.all(particles.species == species)
+    with pytest.raises(ValueError):
+        particles.velocity = np.ones((10,2))
+    with pytest.raises(AttributeError):
+        particles.id = np.arange(110)
+
+    assert particles.velocity.shape == (110,2)
+    assert particles.force.shape == (110,2)
+    assert particles.density.shape == (110,4)
+    assert particles.scalar.shape == (110,)
+    assert np.all(particles.velocity == 0)
+    assert np.all(particles.force == 0)
+    assert np.all(particles.density == 0)
+    assert list(particles.id) == [p.id for p in particles]
+
+def test_bulk_particles():
+    x = np.random.uniform(size=(10,2))
+    v = np.ones((10,2))
+    particles = sparpy.Particles2(x,velocity=v)
+    assert len(particles) == 10
+    assert np.all(particles.position == x)
+    assert np.all(particles.velocity == v)
+    assert np.all(particles.species == 0)
+
+    species = np.arange(5,dtype=float)
+    particles.extend(x[:5],species=species)
+    assert len(particles) == 15
+    assert np.all(particles.position[10:] == x[:5])
+    assert np.all(particles.velocity[10:] == 0)
+    assert np.all(particles.species[10:] == species)
+    assert list(particles.id) == list(range(15))
+
+    with pytest.raises(ValueError):
+        particles.extend(np.ones((3,3)))
+    with pytest.raises(ValueError):
+        particles.extend(x,velocity=np.ones((3,2)))
+    assert len(particles) == 15
+
+    # particles outside a non-periodic search domain are not added
+    particles.init_neighbour_search([0,0],[1,1],[False,False],10)
+    y = np.array([[0.5,0.5],[2.0,0.5],[0.25,0.75]])
+    particles.extend(y,species=np.array([1.0,2.0,3.0]))
+    assert len(particles) == 17
+    assert np.all(particles.position[15:] == y[[0,2]])
+    assert np.all(particles.species[15:] == [1.0,3.0])
+    assert list(particles.id) == list(range(17))
+    _, indices, _ = particles.find_nearest_neighbours(y[[0,2]],1)
+    assert list(indices) == [15,16]
+
+
+
+@pytest.mark.parametrize('suffix',['','_bucket_search_parallel','_bucket_search_hash',
+                                   '_octtree','_nanoflann_adaptor'])
+def test_neighbour_queries(suffix):
+    N = 1000
+    particles = getattr(sparpy,'Particles2'+suffix)(np.random.uniform(size=(N,2)))
+    particles.init_neighbour_search([0,0],[1,1],[True,True],10)
+    x = particles.position
+
+    points = np.random.uniform(size=(50,2))
+    dx = points[:,np.newaxis,:] - x[np.newaxis,:,:]
+    dx -= np.round(dx)
+    r = np.sqrt((dx**2).sum(axis=2))
+
+    radius = 0.1
+    offsets, indices, distances = particles.find_neighbours(points,radius)
+    assert offsets.shape == (51,)
+    assert len(indices) == len(distances) == offsets[-1]
+    for i in range(len(points)):
+        found = indices[offsets[i]:offsets[i+1]]
+        assert sorted(found) == list(np.nonzero(r[i] <= radius)[0])
+        assert np.allclose(distances[offsets[i]:offsets[i+1]], r[i,found])
+
+    k = 5
+    offsets, indices, distances = particles.find_nearest_neighbours(points,k)
+    assert list(offsets) == list(range(0,k*len(points)+1,k))
+    for i in range(len(points)):
+        assert np.allclose(distances[i*k:(i+1)*k], np.sort(r[i])[:k])
+        assert np.allclose(r[i,indices[i*k:(i+1)*k]], np.sort(r[i])[:k])
+
+    with pytest.raises(ValueError):
+        particles.find_nearest_neighbours(points,N+1)
+    with pytest.raises(ValueError):
+        particles.find_neighbours(np.ones((3,3)),radius)
+
+    # a NaN point has no neighbours
+    offsets, indices, distances = particles.find_nearest_neighbours([[np.nan,0.5]],k)
+    assert np.all(indices == N)
+    assert np.all(np.isinf(distances))
+
+    particles = getattr(sparpy,'Particles2'+suffix)(np.random.uniform(size=(N,2)))
+    with pytest.raises(ValueError):
+        particles.find_nearest_neighbours(points,k)
+    with pytest.raises(ValueError):
+        particles.find_neighbours(points,radius)
+
 
 def test_print_particle():
     p = sparpy.Particle2()
@@ -1,5 +1,7 @@
 import sparpy
 import random
+import threading
+import numpy as np
 
 def test_exponential_force():
     N = 100
@@ -58,6 +60,28 @@ def test_lennard_jones_force():
     assert len(particles) == N
 
 
+def test_lennard_jones_force_direction():
+    epsilon = 0.01
+    for separation,repulsive in [(0.008,True),(0.02,False)]:
+        particles = sparpy.Particles2(2)
+        particles[0].position = [0.5-separation/2,0.5]
+        particles[1].position = [0.5+separation/2,0.5]
+
+        simulation = sparpy.Simulation2()
+        simulation.set_domain([0,0],[1,1],[False,False])
+        simulation.add_particles(particles,0.0)
+        simulation.add_force(particles,particles,sparpy.lennard_jones_force2(0.1,epsilon))
+        simulation.integrate(1e-6,1e-6)
+
+        # the force on the left particle points away from the right one
+        # when they repel
+        f0 = particles[0].force
+        f1 = particles[1].force
+        assert (f0[0] < 0) == repulsive
+        assert abs(f0[0]+f1[0]) < 1e-8*abs(f0[0])
+        assert f0[1] == 0 and f1[1] == 0
+
+
 def test_three_dimensions():
     N = 100
     D = 0.001
@@ -88,6 +112,415 @@ def test_three_dimensions():
     assert len(particles) == N
 
 
+def test_all_pairs_matches_neighbour_search():
+    N = 20
+    D = 0.0
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [False,False]
+    dt = 0.001
+    epsilon = 0.1
+    cutoff = 2.0
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for all_pairs in [False,True]:
+        particles = sparpy.Particles2(N)
+        for p,x in zip(particles,positions):
+            p.position = x
+            p.velocity = [0,0]
+
+        simulation = sparpy.Simulation2()
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        simulation.add_force(particles,particles,
+                sparpy.exponential_force2(cutoff,epsilon,all_pairs))
+        simulation.add_force(particles,particles,
+                sparpy.morse_force2(cutoff,1.0,0.2,2.0,0.05,0,all_pairs))
+        simulation.integrate(0.1,dt)
+        final_positions.append([p.position for p in particles])
+
+    for x,y in zip(final_positions[0],final_positions[1]):
+        assert abs(x[0]-y[0]) < 1e-8
+        assert abs(x[1]-y[1]) < 1e-8
+
+
+def test_verlet_list_matches_neighbour_search():
+    N = 100
+    D = 0.01
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+    epsilon = 0.01
+    cutoff = 0.1
+    skin = 0.02
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    # the particles diffuse further than the skin, so that the verlet lists
+    # must be rebuilt during the run
+    final_positions = []
+    for list_skin,threads in [(0.0,1),(skin,1),(skin,4)]:
+        particles = sparpy.Particles2(N)
+        particles.set_seed(1)
+        for p,x in zip(particles,positions):
+            p.position = x
+            p.velocity = [0,0]
+
+        simulation = sparpy.Simulation2()
+        simulation.set_skin(list_skin)
+        simulation.set_threads(threads)
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        simulation.add_force(particles,particles,sparpy.exponential_force2(cutoff,epsilon))
+        simulation.integrate(0.2,dt)
+        final_positions.append(particles.position)
+
+    dx = final_positions[0] - np.array(positions)
+    dx -= np.round(dx)
+    assert np.max(np.sqrt((dx**2).sum(axis=1))) > skin
+
+    for positions in final_positions[1:]:
+        assert np.allclose(final_positions[0],positions,rtol=0,atol=1e-8)
+
+
+def test_grouped_forces():
+    N = 100
+    D = 0.0
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for skin in [0.0,0.02]:
+        for reverse in [False,True]:
+            particles = sparpy.Particles2(N)
+            for i,(p,x) in enumerate(zip(particles,positions)):
+                p.position = x
+                p.velocity = [0,0]
+                p.species = i % 2
+
+            forces = [sparpy.exponential_force2(0.1,0.01),
+                      sparpy.morse_force2(0.05,1.0,0.02,2.0,0.005,1)]
+            if reverse:
+                forces.reverse()
+
+            simulation = sparpy.Simulation2()
+            simulation.set_skin(skin)
+            simulation.set_domain(lower_bound,upper_bound,periodic)
+            simulation.add_particles(particles,D)
+            for force in forces:
+                simulation.add_force(particles,particles,force)
+            simulation.integrate(0.1,dt)
+            final_positions.append([p.position for p in particles])
+
+    for positions in final_positions[1:]:
+        for x,y in zip(final_positions[0],positions):
+            assert abs(x[0]-y[0]) < 1e-8
+            assert abs(x[1]-y[1]) < 1e-8
+
+
+def test_morse_matrix_force():
+    N = 100
+    D = 0.0
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+    parameters = [(0.1,1.0,0.02,2.0,0.005),
+                  (0.05,0.5,0.01,1.0,0.005)]
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for matrix in [False,True]:
+        particles = sparpy.Particles2(N)
+        for i,(p,x) in enumerate(zip(particles,positions)):
+            p.position = x
+            p.velocity = [0,0]
+            p.species = i % 2
+
+        simulation = sparpy.Simulation2()
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        if matrix:
+            force = sparpy.morse_matrix_force2(2)
+            for species_i in range(2):
+                for species_j in range(2):
+                    force.set(species_i,species_j,*parameters[species_j])
+            simulation.add_force(particles,particles,force)
+        else:
+            for species_j in range(2):
+                simulation.add_force(particles,particles,
+                        sparpy.morse_force2(*(parameters[species_j] + (species_j,))))
+        simulation.integrate(0.1,dt)
+        final_positions.append([p.position for p in particles])
+
+    for x,y in zip(final_positions[0],final_positions[1]):
+        assert abs(x[0]-y[0]) < 1e-8
+        assert abs(x[1]-y[1]) < 1e-8
+
+
+def test_integration_independent_of_threads():
+    N = 100
+    D = 0.01
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [False,True]
+    dt = 0.001
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for threads in [1,4]:
+        particles = sparpy.Particles2(N)
+        for p,x in zip(particles,positions):
+            p.position = x
+            p.velocity = [0,0]
+        particles.set_seed(1)
+
+        simulation = sparpy.Simulation2()
+        simulation.set_threads(threads)
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        simulation.integrate(0.1,dt)
+        final_positions.append([p.position for p in particles])
+
+    for x,y in zip(final_positions[0],final_positions[1]):
+        assert x[0] == y[0]
+        assert x[1] == y[1]
+    for x in final_positions[0]:
+        assert lower_bound[0] <= x[0] <= upper_bound[0]
+
+
+def test_integrate_in_threads():
+    N = 100
+    D = 0.01
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    def run(seed,results):
+        particles = sparpy.Particles2(N)
+        for p,x in zip(particles,positions):
+            p.position = x
+            p.velocity = [0,0]
+        particles.set_seed(seed)
+
+        simulation = sparpy.Simulation2()
+        simulation.set_threads(1)
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        simulation.add_force(particles,particles,sparpy.exponential_force2(0.1,0.01))
+        simulation.integrate(0.1,dt)
+        results[seed] = [p.position for p in particles]
+
+    # integrate releases the GIL, so independent simulations can run on 
+    # separate Python threads, and must give the same results as serial runs
+    serial_results = {}
+    for seed in range(4):
+        run(seed,serial_results)
+
+    threaded_results = {}
+    threads = [threading.Thread(target=run,args=(seed,threaded_results)) 
+                                                    for seed in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    for seed in range(4):
+        for x,y in zip(serial_results[seed],threaded_results[seed]):
+            assert x[0] == y[0]
+            assert x[1] == y[1]
+
+
+def test_reorder_particles():
+    N = 100
+    D = 0.01
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for skin,interval in [(0.0,0),(0.0,10),(0.02,10)]:
+        particles = sparpy.Particles2(N)
+        for p,x in zip(particles,positions):
+            p.position = x
+            p.velocity = [0,0]
+        particles.set_seed(1)
+
+        simulation = sparpy.Simulation2()
+        simulation.set_skin(skin)
+        simulation.set_reorder_interval(interval)
+        simulation.set_domain(lower_bound,upper_bound,periodic)
+        simulation.add_particles(particles,D)
+        simulation.add_force(particles,particles,sparpy.exponential_force2(0.1,0.01))
+        simulation.integrate(0.1,dt)
+        final_positions.append(dict((p.id,p.position) for p in particles))
+
+    for positions in final_positions[1:]:
+        assert len(positions) == N
+        for i,x in final_positions[0].items():
+            assert abs(x[0]-positions[i][0]) < 1e-8
+            assert abs(x[1]-positions[i][1]) < 1e-8
+
+
+def test_search_backends():
+    N = 100
+    D = 0.0
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+    dt = 0.001
+
+    positions = [[random.uniform(lower_bound[0],upper_bound[0]),
+                  random.uniform(lower_bound[1],upper_bound[1])] for i in range(N)]
+
+    final_positions = []
+    for suffix in ['','_bucket_search_parallel','_bucket_search_hash','_octtree',
+                   '_nanoflann_adaptor']:
+        for skin in [0.0,0.02]:
+            particles = getattr(sparpy,'Particles2'+suffix)(N)
+            for p,x in zip(particles,positions):
+                p.position = x
+                p.velocity = [0,0]
+
+            simulation = getattr(sparpy,'Simulation2'+suffix)()
+            simulation.set_skin(skin)
+            simulation.set_domain(lower_bound,upper_bound,periodic)
+            simulation.add_particles(particles,D)
+            simulation.add_force(particles,particles,sparpy.exponential_force2(0.1,0.01))
+            simulation.integrate(0.1,dt)
+            final_positions.append(dict((p.id,p.position) for p in particles))
+
+    for positions in final_positions[1:]:
+        assert len(positions) == N
+        for i,x in final_positions[0].items():
+            assert abs(x[0]-positions[i][0]) < 1e-8
+            assert abs(x[1]-positions[i][1]) < 1e-8
+
+
+def test_update_grid():
+    N = 100
+    x = np.random.uniform(size=(N,2))
+    v = np.random.uniform(size=(N,2))
+    particles = sparpy.Particles2(x,velocity=v)
+    simulation = sparpy.Simulation2()
+    simulation.set_domain([0,0],[1,1],[True,True])
+    simulation.add_particles(particles,0.001)
+
+    simulation.update_grid(particles,1.0,0.0)
+    assert np.all(particles.species == 0)
+
+    # every coral dies, but time does not advance
+    simulation.update_grid(particles,1.0,2.0)
+    assert np.all(particles.species == 1)
+    assert np.all(particles.position == x)
+    assert np.all(particles.velocity == v)
+
+
+def test_set_positions_between_integrate():
+    N = 200
+    cutoff = 0.1
+    epsilon = 0.01
+    for suffix in ['','_bucket_search_hash','_octtree']:
+        for skin in [0.0,0.02]:
+            particles = getattr(sparpy,'Particles2'+suffix)(np.random.uniform(size=(N,2)))
+            simulation = getattr(sparpy,'Simulation2'+suffix)()
+            simulation.set_skin(skin)
+            simulation.set_domain([0,0],[1,1],[True,True])
+            simulation.add_particles(particles,0.0)
+            simulation.add_force(particles,particles,sparpy.exponential_force2(cutoff,epsilon))
+            simulation.integrate(0.01,0.001)
+
+            # a single step that is too short to move the particles, so the
+            # forces are those at the new positions
+            particles.position = np.random.uniform(size=(N,2))
+            particles.velocity = np.zeros((N,2))
+            simulation.integrate(1e-9,0.001)
+
+            x = particles.position
+            dx = x[np.newaxis,:,:] - x[:,np.newaxis,:]
+            dx -= np.round(dx)
+            r = np.sqrt((dx**2).sum(axis=2))
+            np.fill_diagonal(r,np.inf)
+            c = np.where(r <= cutoff,np.exp(-r/epsilon)/(epsilon*r),0)
+            expected = (c[:,:,np.newaxis]*dx).sum(axis=1)
+            assert np.allclose(particles.force,expected,rtol=1e-8,atol=1e-8)
+
+
+def test_tabulated_force():
+    N = 100
+    cutoff = 0.1
+    lower_bound = [0,0]
+    upper_bound = [1,1]
+    periodic = [True,True]
+
+    positions = np.random.uniform(size=(N,2))
+    dx = positions[:,np.newaxis,:] - positions[np.newaxis,:,:]
+    dx -= np.round(dx)
+    neighbours = ((dx**2).sum(axis=2) <= cutoff**2).sum(axis=1) - 1
+
+    for make_force in [lambda: sparpy.morse_force2(cutoff,1.0,0.02,2.0,0.005,0),
+                       lambda: sparpy.exponential_force2(cutoff,0.01)]:
+        forces = []
+        for tabulate in [False,True]:
+            force = make_force()
+            if tabulate:
+                error = force.tabulate(1000)
+                assert error < 1e-3
+
+            particles = sparpy.Particles2(positions)
+            simulation = sparpy.Simulation2()
+            simulation.set_domain(lower_bound,upper_bound,periodic)
+            simulation.add_particles(particles,0.0)
+            simulation.add_force(particles,particles,force)
+
+            # the particles start at rest, so the forces after one step are
+            # those at the initial positions
+            simulation.integrate(0.001,0.001)
+            assert np.allclose(particles.position,positions)
+            forces.append(particles.force.copy())
+
+        # the table is used, and its error is at most error per neighbour
+        # (with some slack, as error is only sampled at a few points of each
+        # interval)
+        difference = np.abs(forces[1]-forces[0]).max(axis=1)
+        assert difference.max() > 0
+        assert np.all(difference <= 2*error*neighbours)
+
+    particles = sparpy.Particles2(N)
+    for p in particles:
+        p.position = [random.uniform(0,1),random.uniform(0,1)]
+
+    simulation = sparpy.Simulation2()
+    simulation.set_domain(lower_bound,upper_bound,periodic)
+    simulation.add_particles(particles,0.001)
+    simulation.add_force(particles,particles,force)
+    simulation.integrate(0.1,0.001)
+
+    assert len(particles) == N
+
+
 if __name__ == "__main__":
     test_lennard_jones_force()
 